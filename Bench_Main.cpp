@@ -0,0 +1,533 @@
+#include "Benchmark.hpp"
+#include "Map.hpp"
+#include "Map_Rendered.hpp"
+#include "Pathfinder.hpp"
+#include "Terrain_Coverage.hpp"
+#include "Territory.hpp"
+
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <sstream>
+
+// Count every heap allocation so each benchmark can report allocations per
+// operation. The array and nothrow forms forward to these.
+void *operator new(size_t t_size)
+{
+  ++allocation_count();
+
+  if (void *p = std::malloc(t_size ? t_size : 1))
+  {
+    return p;
+  }
+
+  throw std::bad_alloc();
+}
+
+void operator delete(void *t_p) noexcept
+{
+  std::free(t_p);
+}
+
+void *operator new[](size_t t_size)
+{
+  return operator new(t_size);
+}
+
+void operator delete[](void *t_p) noexcept
+{
+  operator delete(t_p);
+}
+
+namespace
+{
+  volatile long sink;
+
+  std::string filter;
+
+  void run(const std::string &t_name, const std::function<void ()> &t_func, const std::string &t_extra = std::string())
+  {
+    if (t_name.find(filter) != std::string::npos)
+    {
+      report(benchmark(t_name, t_func), t_extra);
+    }
+  }
+
+  std::string name(const std::string &t_name, int t_value)
+  {
+    std::stringstream ss;
+    ss << t_name << "/" << t_value;
+    return ss.str();
+  }
+
+  std::string name(const std::string &t_name, int t_width, int t_height)
+  {
+    std::stringstream ss;
+    ss << t_name << "/" << t_width << "x" << t_height;
+    return ss.str();
+  }
+
+  std::string bytes(size_t t_bytes)
+  {
+    std::stringstream ss;
+    ss << t_bytes << " bytes";
+    return ss.str();
+  }
+
+  const Terrain_Type terrain_types[] = { Mountain, Plain, Water, Swamp, Forest };
+  const Location locations[] = { NorthEast, North, NorthWest, East, Central, West, SouthEast, South, SouthWest };
+
+  /// t_num_terrains terrains and t_num_features features spread over all
+  /// locations
+  Map make_map(int t_num_terrains, int t_num_features)
+  {
+    Map map(Swamp);
+
+    for (int i = 0; i < t_num_terrains; ++i)
+    {
+      map.add_terrain(Map_Terrain(locations[i % 9], terrain_types[i % 5]));
+    }
+
+    for (int i = 0; i < t_num_features; ++i)
+    {
+      map.add_map_feature(Map_Feature(locations[(i * 4) % 9], i % 3 ? Town : Cave));
+    }
+
+    return map;
+  }
+
+  Map sample_map()
+  {
+    Map map(Swamp);
+    map.add_terrain(Map_Terrain(East, Forest));
+    map.add_terrain(Map_Terrain(West, Plain));
+    map.add_terrain(Map_Terrain(Central, Mountain));
+    map.add_terrain(Map_Terrain(NorthEast, Mountain));
+    map.add_terrain(Map_Terrain(NorthWest, Water));
+    map.add_terrain(Map_Terrain(South, Mountain));
+
+    map.add_map_feature(Map_Feature(SouthWest, Town));
+    map.add_map_feature(Map_Feature(SouthWest, Town));
+    map.add_map_feature(Map_Feature(SouthWest, Cave));
+    map.add_map_feature(Map_Feature(NorthEast, Town));
+    return map;
+  }
+
+  void bench_region()
+  {
+    const Region region(4.0 / 3.0, 1.0);
+
+    for (int division: {3, 10, 32})
+    {
+      run(name("Region::subdivide", division, division),
+          [&]()
+          {
+            double sum = 0;
+            for (const Region &cell: region.subdivide(division, division))
+            {
+              sum += cell.width();
+            }
+            sink = long(sum);
+          });
+    }
+
+    run("Region::get_location",
+        [&]()
+        {
+          double sum = 0;
+          for (Location location: locations)
+          {
+            sum += region.get_location(location).width();
+          }
+          sink = long(sum);
+        });
+
+    run("Region::contains/1024 points",
+        [&]()
+        {
+          long inside = 0;
+          for (int y = 0; y < 32; ++y)
+          {
+            for (int x = 0; x < 32; ++x)
+            {
+              inside += region.get_location(Central).contains(Point(region.width() * x / 32, region.height() * y / 32));
+            }
+          }
+          sink = inside;
+        });
+  }
+
+  /// One operation classifies a 32x32 grid of points over the shape's region
+  void bench_shape()
+  {
+    const Region region(4.0 / 3.0, 1.0);
+    Random_Stream random(0);
+    const Shape shape(region.get_location(Central), random);
+
+    run("Shape::Shape",
+        [&]()
+        {
+          Random_Stream shape_random(0);
+          sink = Shape(region.get_location(Central), shape_random).contains(Point(0, 0));
+        });
+
+    std::vector<double> xs;
+    std::vector<double> ys;
+    for (int y = 0; y < 32; ++y)
+    {
+      for (int x = 0; x < 32; ++x)
+      {
+        xs.push_back(region.width() * x / 32);
+        ys.push_back(region.height() * y / 32);
+      }
+    }
+
+    run("Shape::contains/1024 points",
+        [&]()
+        {
+          long inside = 0;
+          for (size_t i = 0; i < xs.size(); ++i)
+          {
+            inside += shape.contains(Point(xs[i], ys[i]));
+          }
+          sink = inside;
+        });
+
+    std::unique_ptr<bool[]> inside(new bool[xs.size()]);
+
+    run("Shape::contains_batch/1024 points",
+        [&]()
+        {
+          shape.contains_batch(xs.data(), ys.data(), int(xs.size()), inside.get());
+          sink = inside[0];
+        });
+  }
+
+  void bench_render_stages()
+  {
+    for (int num_terrains: {4, 16, 64})
+    {
+      const Map map = make_map(num_terrains, 0);
+
+      run(name("Map::render_terrain/terrains", num_terrains),
+          [&]()
+          {
+            const Random_Stream random(0);
+            Map::Map_Rendered rendered(Swamp, 4.0 / 3.0);
+            map.render_terrain(rendered, random);
+            sink = long(rendered.terrains.size());
+          });
+    }
+
+    for (int num_features: {4, 64, 1024})
+    {
+      const Map map = make_map(0, num_features);
+
+      run(name("Map::render_features/features", num_features),
+          [&]()
+          {
+            const Random_Stream random(0);
+            Map::Map_Rendered rendered(Swamp, 4.0 / 3.0);
+            map.render_features(rendered, random);
+            sink = long(rendered.features.size());
+          });
+    }
+
+    for (int size: {64, 256, 1024})
+    {
+      for (int count: {4, 64})
+      {
+        const Map map = make_map(count, count * 4);
+
+        const Random_Stream random(0);
+        Map::Map_Rendered rendered(Swamp, 1.0);
+        map.render_terrain(rendered, random);
+        map.render_features(rendered, random);
+
+        for (int rasterizer: {Scanline_Rasterizer, Point_Query_Rasterizer})
+        {
+          Render_Options options;
+          options.rasterizer = Rasterizer(rasterizer);
+
+          std::stringstream ss;
+          ss << "Map::make_instance/" << (rasterizer == Scanline_Rasterizer ? "scanline" : "point_query")
+            << "/terrains/" << count << "/features/" << count * 4;
+
+          run(name(ss.str(), size, size),
+              [&]()
+              {
+                sink = map.make_instance(16, 16, size, size, rendered, options).num_horizontal();
+              });
+        }
+
+        std::stringstream ss;
+        ss << "Map::render_coverage/terrains/" << count;
+
+        run(name(ss.str(), size, size),
+            [&]()
+            {
+              sink = map.render_coverage(16, 16, size, size, random).num_horizontal();
+            });
+      }
+    }
+  }
+
+  /// Packed Map_Instance storage against the previous layout of one
+  /// Map_Tile struct per tile. The copies read back one tile per row so
+  /// they cannot be optimised away.
+  void bench_tile_storage(int t_size)
+  {
+    const Random_Stream random(0);
+    const Map_Instance packed = sample_map().render(16, 16, t_size, t_size, random);
+
+    std::vector<Map_Instance::Map_Tile> unpacked;
+    for (int y = 0; y < t_size; ++y)
+    {
+      for (int x = 0; x < t_size; ++x)
+      {
+        unpacked.push_back(packed.at(x, y));
+      }
+    }
+
+    run(name("tile_storage/packed/iterate", t_size, t_size),
+        [&]()
+        {
+          long histogram[Forest + 1] = { 0 };
+          for (int y = 0; y < t_size; ++y)
+          {
+            for (int x = 0; x < t_size; ++x)
+            {
+              ++histogram[packed.at(x, y).terrain_type];
+            }
+          }
+          sink = histogram[Mountain];
+        },
+        bytes(packed.tile_storage_bytes()));
+
+    run(name("tile_storage/unpacked/iterate", t_size, t_size),
+        [&]()
+        {
+          long histogram[Forest + 1] = { 0 };
+          for (const auto &tile: unpacked)
+          {
+            ++histogram[tile.terrain_type];
+          }
+          sink = histogram[Mountain];
+        },
+        bytes(unpacked.size() * sizeof(Map_Instance::Map_Tile)));
+
+    run(name("tile_storage/packed/copy", t_size, t_size),
+        [&]()
+        {
+          Map_Instance copy(packed);
+          long sum = 0;
+          for (int i = 0; i < t_size; ++i)
+          {
+            sum += copy.at(i, i).terrain_type;
+          }
+          sink = sum;
+        });
+
+    run(name("tile_storage/unpacked/copy", t_size, t_size),
+        [&]()
+        {
+          std::vector<Map_Instance::Map_Tile> copy(unpacked);
+          long sum = 0;
+          for (int i = 0; i < t_size; ++i)
+          {
+            sum += copy[size_t(i) * t_size + i].terrain_type;
+          }
+          sink = sum;
+        });
+  }
+
+  /// Routes between every pair of features, answered from scratch with a
+  /// one entry cache and then again from a cache holding all of them.
+  void bench_pathfinder(int t_size)
+  {
+    const Random_Stream random(0);
+    const Map_Instance map = make_map(9, 24).render(16, 16, t_size, t_size, random);
+    const std::vector<Map_Position> features = Pathfinder::feature_positions(map);
+
+    run(name("Pathfinder::Pathfinder", t_size, t_size),
+        [&]()
+        {
+          sink = Pathfinder(map).num_clusters();
+        });
+
+    Pathfinder uncached(map, Pathfinder::default_cluster_size, 1);
+    Pathfinder cached(map, Pathfinder::default_cluster_size, features.size() * features.size());
+
+    const auto route_all = [&](Pathfinder &t_pathfinder)
+    {
+      long cost = 0;
+      for (const Map_Position &from: features)
+      {
+        for (const Map_Position &to: features)
+        {
+          cost += t_pathfinder.find_path(from, to).cost;
+        }
+      }
+      sink = cost;
+    };
+
+    std::stringstream pairs;
+    pairs << features.size() * features.size() << " paths";
+
+    run(name("Pathfinder::find_path/uncached", t_size, t_size), [&]() { route_all(uncached); }, pairs.str());
+    run(name("Pathfinder::find_path/cached", t_size, t_size), [&]() { route_all(cached); }, pairs.str());
+  }
+
+  void bench_territory(int t_size)
+  {
+    const Random_Stream random(0);
+    const Map_Instance map = make_map(9, 60).render(16, 16, t_size, t_size, random);
+    const std::vector<Map_Position> towns = Territory::town_positions(map);
+
+    std::stringstream sources;
+    sources << towns.size() << " towns";
+
+    run(name("Territory::nearest_euclidean", t_size, t_size),
+        [&]()
+        {
+          sink = Territory::nearest_euclidean(map, towns).owner(0, 0);
+        },
+        sources.str());
+
+    run(name("Territory::nearest_by_cost", t_size, t_size),
+        [&]()
+        {
+          sink = Territory::nearest_by_cost(map, towns).owner(0, 0);
+        },
+        sources.str());
+
+    // more sources than the direct scan takes, so this runs jump flooding
+    std::vector<Map_Position> grid;
+    for (int y = 0; y < 16; ++y)
+    {
+      for (int x = 0; x < 16; ++x)
+      {
+        grid.push_back(Map_Position((2 * x + 1) * t_size / 32, (2 * y + 1) * t_size / 32));
+      }
+    }
+
+    run(name("Territory::nearest_euclidean/grid", t_size, t_size),
+        [&]()
+        {
+          sink = Territory::nearest_euclidean(map, grid).owner(0, 0);
+        },
+        "256 sources");
+  }
+
+  /// Number of tiles in which t_lhs and t_rhs differ, both of the same size
+  size_t count_differences(const Map_Instance &t_lhs, const Map_Instance &t_rhs)
+  {
+    std::vector<std::uint8_t> lhs_row(t_lhs.num_horizontal());
+    std::vector<std::uint8_t> rhs_row(t_rhs.num_horizontal());
+    size_t differences = 0;
+
+    for (int y = 0; y < t_lhs.num_vertical(); ++y)
+    {
+      t_lhs.read_row(0, y, t_lhs.num_horizontal(), lhs_row.data());
+      t_rhs.read_row(0, y, t_rhs.num_horizontal(), rhs_row.data());
+
+      for (size_t x = 0; x < lhs_row.size(); ++x)
+      {
+        differences += lhs_row[x] != rhs_row[x];
+      }
+    }
+
+    return differences;
+  }
+
+  /// Renders maps in every way that has to give the same tiles as the single
+  /// threaded, dense scanline render and prints the differing tiles of each.
+  /// Returns the number of renders that differ.
+  int validate()
+  {
+    struct Variant
+    {
+      const char *name;
+      Rasterizer rasterizer;
+      int num_threads;
+      int chunk_size;
+    };
+
+    // a small chunk cache, so chunks are dropped and generated again
+    const Variant variants[] = {
+      { "point_query", Point_Query_Rasterizer, 1, 0 },
+      { "4 threads", Scanline_Rasterizer, 4, 0 },
+      { "chunked", Scanline_Rasterizer, 1, 32 },
+      { "chunked point_query", Point_Query_Rasterizer, 1, 32 }
+    };
+
+    const Map map = make_map(24, 120);
+    int failures = 0;
+
+    for (int seed = 0; seed < 5; ++seed)
+    {
+      const Random_Stream random(seed);
+
+      Render_Options reference_options;
+      reference_options.num_threads = 1;
+      const Map_Instance reference = map.render(16, 16, 300, 200, random, reference_options);
+
+      for (const Variant &variant: variants)
+      {
+        Render_Options options;
+        options.rasterizer = variant.rasterizer;
+        options.num_threads = variant.num_threads;
+        options.chunk_size = variant.chunk_size;
+        options.max_cached_chunks = 8;
+
+        const size_t differences = count_differences(reference, map.render(16, 16, 300, 200, random, options));
+
+        std::cout << "seed " << seed << ", " << variant.name << ": " << differences << " differing tiles" << std::endl;
+
+        if (differences)
+        {
+          ++failures;
+        }
+      }
+    }
+
+    std::cout << (failures ? "validation failed" : "validation passed") << std::endl;
+
+    return failures;
+  }
+}
+
+/// worldbuilder_bench [filter]
+/// worldbuilder_bench --validate
+///
+/// Runs every benchmark whose name contains filter, all of them by default.
+/// With --validate, checks that the rasterizers, thread counts and tile
+/// storage all render the same tiles instead, see validate(), and exits
+/// with 1 on any difference.
+int main(int argc, char *argv[])
+{
+  if (argc > 1 && std::string(argv[1]) == "--validate")
+  {
+    return validate() ? 1 : 0;
+  }
+
+  if (argc > 1)
+  {
+    filter = argv[1];
+  }
+
+  bench_region();
+  bench_shape();
+  bench_render_stages();
+
+  for (int size: {256, 1024, 2048})
+  {
+    bench_tile_storage(size);
+  }
+
+  for (int size: {256, 1024})
+  {
+    bench_pathfinder(size);
+    bench_territory(size);
+  }
+}
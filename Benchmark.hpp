@@ -0,0 +1,66 @@
+#ifndef WORLDBUILDER_BENCHMARK_HPP
+#define WORLDBUILDER_BENCHMARK_HPP
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+/// Minimal timing harness for the worldbuilder_bench target, kept free of SDL
+/// and of any benchmarking library so it builds wherever the generator does.
+struct Benchmark_Result
+{
+  std::string name;
+  long iterations;
+  double ns_per_op;
+  double allocations_per_op;
+};
+
+/// Heap allocations made so far, counted by the replacement operator new of
+/// the benchmark executable
+inline std::atomic<long> &allocation_count()
+{
+  static std::atomic<long> count(0);
+  return count;
+}
+
+/// Calls t_func until at least t_min_ms have passed and reports the mean time
+/// and heap allocations per call. One untimed call warms up caches first.
+template<typename Func>
+  Benchmark_Result benchmark(const std::string &t_name, const Func &t_func, double t_min_ms = 200)
+  {
+    typedef std::chrono::steady_clock clocktype;
+
+    t_func();
+
+    Benchmark_Result result;
+    result.name = t_name;
+    result.iterations = 0;
+
+    const long start_allocations = allocation_count();
+    const clocktype::time_point start = clocktype::now();
+    double elapsed_ms = 0;
+
+    while (elapsed_ms < t_min_ms)
+    {
+      t_func();
+      ++result.iterations;
+      elapsed_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(clocktype::now() - start).count();
+    }
+
+    result.ns_per_op = elapsed_ms * 1e6 / result.iterations;
+    result.allocations_per_op = double(allocation_count() - start_allocations) / result.iterations;
+    return result;
+  }
+
+inline void report(const Benchmark_Result &t_result, const std::string &t_extra = std::string())
+{
+  std::cout << std::left << std::setw(64) << t_result.name
+    << std::right << std::setw(10) << t_result.iterations << " iterations "
+    << std::setw(14) << std::fixed << std::setprecision(1) << t_result.ns_per_op << " ns/op"
+    << std::setw(12) << std::setprecision(2) << t_result.allocations_per_op << " allocs/op"
+    << (t_extra.empty() ? "" : "  ") << t_extra << std::endl;
+}
+
+#endif
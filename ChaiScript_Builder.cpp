@@ -3,6 +3,77 @@
 
 #include "World.hpp"
 #include <chaiscript/utility/utility.hpp>
+#include <chaiscript/dispatchkit/bootstrap_stl.hpp>
+
+#include <algorithm>
+
+namespace
+{
+  // Bulk entry points, so scripts pay the dispatch overhead once per call
+  // rather than once per element.
+
+  template<typename T>
+    std::vector<T> unbox_all(const std::vector<chaiscript::Boxed_Value> &t_values)
+    {
+      std::vector<T> result;
+      result.reserve(t_values.size());
+
+      for (const auto &value: t_values)
+      {
+        result.push_back(chaiscript::boxed_cast<const T &>(value));
+      }
+
+      return result;
+    }
+
+  void add_terrains(Map &t_map, const std::vector<chaiscript::Boxed_Value> &t_terrains)
+  {
+    t_map.add_terrains(unbox_all<Map_Terrain>(t_terrains));
+  }
+
+  void add_map_features(Map &t_map, const std::vector<chaiscript::Boxed_Value> &t_features)
+  {
+    t_map.add_map_features(unbox_all<Map_Feature>(t_features));
+  }
+
+  void add_map_features_count(Map &t_map, Location t_location, Feature_Type t_type, int t_count)
+  {
+    t_map.add_map_features(std::vector<Map_Feature>(std::max(0, t_count), Map_Feature(t_location, t_type)));
+  }
+
+  // Returned as the registered Map_Tile_Vector type, so a tile is only
+  // boxed when a script indexes it
+
+  std::vector<Map_Instance::Map_Tile> tile_rect(const Map_Instance &t_map, int x, int y, int t_width, int t_height)
+  {
+    return t_map.tiles(x, y, t_width, t_height);
+  }
+
+  std::vector<Map_Instance::Map_Tile> tile_row(const Map_Instance &t_map, int y)
+  {
+    return t_map.tiles(0, y, t_map.num_horizontal(), 1);
+  }
+
+  Map_Instance render_map(const World &t_world, int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, int t_seed)
+  {
+    return t_world.render_map(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, t_seed);
+  }
+
+  // ChaiScript has no comparison for registered enums, scripts need them to
+  // inspect the tiles of a rendered map
+
+  template<typename Enum>
+    bool enum_equal(Enum t_lhs, Enum t_rhs)
+    {
+      return t_lhs == t_rhs;
+    }
+
+  template<typename Enum>
+    bool enum_not_equal(Enum t_lhs, Enum t_rhs)
+    {
+      return t_lhs != t_rhs;
+    }
+}
 
 std::shared_ptr<chaiscript::ChaiScript> ChaiScript_Builder::build()
 {
@@ -28,13 +99,36 @@ std::shared_ptr<chaiscript::ChaiScript> ChaiScript_Builder::build()
       "Map",
       { constructor<Map(Terrain_Type)>() },
       { {fun(&Map::add_terrain), "add_terrain"},
-        {fun(&Map::add_map_feature), "add_map_feature"} }
+        {fun(&Map::add_map_feature), "add_map_feature"},
+        {fun(&add_terrains), "add_terrains"},
+        {fun(&add_map_features), "add_map_features"},
+        {fun(&add_map_features_count), "add_map_features"} }
+      );
+
+  chaiscript::utility::add_class<Map_Instance::Map_Tile>(*chai,
+      "Map_Tile",
+      {  },
+      { {fun(&Map_Instance::Map_Tile::terrain_type), "terrain_type"},
+        {fun(&Map_Instance::Map_Tile::feature_type), "feature_type"} }
+      );
+
+  chai->add(bootstrap::standard_library::vector_type<std::vector<Map_Instance::Map_Tile>>("Map_Tile_Vector"));
+
+  chaiscript::utility::add_class<Map_Instance>(*chai,
+      "Map_Instance",
+      {  },
+      { {fun(&Map_Instance::at), "at"},
+        {fun(&Map_Instance::num_horizontal), "num_horizontal"},
+        {fun(&Map_Instance::num_vertical), "num_vertical"},
+        {fun(&tile_row), "row"},
+        {fun(&tile_rect), "rect"} }
       );
 
   chaiscript::utility::add_class<World>(*chai,
       "World",
       {  },
-      { {fun(&World::add_map), "add_map"}
+      { {fun(&World::add_map), "add_map"},
+        {fun(&render_map), "render_map"}
       }
       );
 
@@ -59,6 +153,11 @@ std::shared_ptr<chaiscript::ChaiScript> ChaiScript_Builder::build()
   chai->add(const_var(Cave), "Cave");
   chai->add(const_var(Town), "Town");
 
+  chai->add(fun(&enum_equal<Terrain_Type>), "==");
+  chai->add(fun(&enum_not_equal<Terrain_Type>), "!=");
+  chai->add(fun(&enum_equal<Feature_Type>), "==");
+  chai->add(fun(&enum_not_equal<Feature_Type>), "!=");
+
   return chai;
 }
 
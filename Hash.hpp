@@ -0,0 +1,36 @@
+#ifndef WORLDBUILDER_HASH_HPP
+#define WORLDBUILDER_HASH_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/// 64 bit FNV-1a. Not cryptographic, only used to tell whether a cache file
+/// was built from the same input.
+inline std::uint64_t fnv1a_hash(const std::string &t_data, std::uint64_t t_hash = 14695981039346656037ull)
+{
+  for (const char c: t_data)
+  {
+    t_hash = (t_hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+  }
+
+  return t_hash;
+}
+
+inline std::string read_file(const std::string &t_filename)
+{
+  std::ifstream file(t_filename.c_str(), std::ios::in | std::ios::binary);
+
+  if (!file)
+  {
+    throw std::runtime_error("Unable to open file: " + t_filename);
+  }
+
+  std::stringstream ss;
+  ss << file.rdbuf();
+  return ss.str();
+}
+
+#endif
@@ -1,6 +1,19 @@
 #include "Map.hpp"
+#include "Map_Chunk_Cache.hpp"
+#include "Map_Rendered.hpp"
+#include "Profiler.hpp"
+#include "Terrain_Coverage.hpp"
+#include "Thread_Pool.hpp"
 
+#include <algorithm>
 #include <stdexcept>
+#include <memory>
+
+namespace
+{
+  /// chunk size an externally owned map is split into on its first write
+  const int external_chunk_size = 64;
+}
 
 Map_Feature::Map_Feature(Location t_location, Feature_Type t_type)
   : location(t_location), type(t_type)
@@ -14,149 +27,230 @@ Map_Terrain::Map_Terrain(Location t_location, Terrain_Type t_type)
 }
 
 
+Dirty_Rect::Dirty_Rect(int t_x, int t_y, int t_width, int t_height)
+  : x(t_x), y(t_y), width(t_width), height(t_height)
+{
+}
+
+
+Render_Options::Render_Options()
+  : num_threads(1), rasterizer(Scanline_Rasterizer), chunk_size(0), max_cached_chunks(1024)
+{
+}
+
+
 Map_Instance::Map_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical)
-  : m_tiles(t_num_horizontal * t_num_vertical),
+  : m_tiles(size_t(t_num_horizontal) * t_num_vertical), m_external_tiles(nullptr),
     m_tile_width(t_tile_width), m_tile_height(t_tile_height), m_num_horizontal(t_num_horizontal), m_num_vertical(t_num_vertical)
 {
 }
 
-const Map_Instance::Map_Tile &Map_Instance::at(int x, int y) const
+Map_Instance::Map_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+    const std::shared_ptr<Map_Chunk_Cache> &t_chunks)
+  : m_external_tiles(nullptr), m_chunks(t_chunks),
+    m_tile_width(t_tile_width), m_tile_height(t_tile_height), m_num_horizontal(t_num_horizontal), m_num_vertical(t_num_vertical)
 {
-  if (x >= m_num_horizontal || y >= m_num_vertical || x < 0 || y < 0)
-  {
-    throw std::range_error("Outside of map range");
-  }
-
-  return m_tiles[y * m_num_horizontal + x];
 }
 
-int Map_Instance::num_horizontal() const
+Map_Instance::Map_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+    const std::shared_ptr<const void> &t_owner, const std::uint8_t *t_tiles)
+  : m_external_owner(t_owner), m_external_tiles(t_tiles),
+    m_tile_width(t_tile_width), m_tile_height(t_tile_height), m_num_horizontal(t_num_horizontal), m_num_vertical(t_num_vertical)
 {
-  return m_num_horizontal;
 }
 
-int Map_Instance::num_vertical() const
+Map_Instance::Map_Tile Map_Instance::chunk_at(int x, int y) const
 {
-  return m_num_vertical;
+  const int chunk_size = m_chunks->chunk_size();
+  return unpack((*read_chunk(x / chunk_size, y / chunk_size))[(y % chunk_size) * chunk_size + x % chunk_size]);
 }
 
-Map_Instance::Map_Tile &Map_Instance::at(int x, int y) 
+std::shared_ptr<const std::vector<std::uint8_t>> Map_Instance::read_chunk(int t_chunk_x, int t_chunk_y) const
 {
-  if (x >= m_num_horizontal || y >= m_num_vertical || x < 0 || y < 0)
+  auto written = m_written_chunks.find(std::make_pair(t_chunk_x, t_chunk_y));
+  if (written != m_written_chunks.end())
   {
-    throw std::range_error("Outside of map range");
+    return m_chunks->read(*written->second);
   }
 
-  return m_tiles[y * m_num_horizontal + x];
+  return m_chunks->get(t_chunk_x, t_chunk_y);
 }
 
-
-struct Map::Map_Rendered
+std::shared_ptr<std::vector<std::uint8_t>> Map_Instance::modify_chunk(int t_chunk_x, int t_chunk_y)
 {
-  Map_Rendered(Terrain_Type t_background, double t_aspect_ratio)
-    : background(t_background), aspect_ratio(t_aspect_ratio)
+  std::shared_ptr<Map_Written_Chunk> &written = m_written_chunks[std::make_pair(t_chunk_x, t_chunk_y)];
+
+  if (!written)
   {
+    written = m_chunks->write(*m_chunks->get(t_chunk_x, t_chunk_y));
+  } else if (!written.unique()) {
+    // still shared with a copy of this instance, copy on write
+    written = m_chunks->write(*m_chunks->read(*written));
   }
 
-  struct Map_Rendered_Terrain
-  {
-    Map_Rendered_Terrain(const Shape &t_shape, Terrain_Type t_type)
-      : shape(t_shape), type(t_type)
-    {
-    }
+  return m_chunks->modify(*written);
+}
 
-    Shape shape;
-    Terrain_Type type;
-  };
+void Map_Instance::set(int x, int y, const Map_Tile &t_tile)
+{
+  const std::uint8_t tile = pack(t_tile);
+  write_row(x, y, 1, &tile);
+}
 
-  struct Map_Rendered_Feature
+void Map_Instance::check_row(int x, int y, int t_width) const
+{
+  if (t_width < 0 || x < 0 || y < 0 || x > m_num_horizontal - t_width || y >= m_num_vertical)
   {
-    Map_Rendered_Feature(const Point &t_point, Feature_Type t_type)
-      : point(t_point), type(t_type)
-    {
-    }
+    throw std::range_error("Outside of map range");
+  }
+}
 
-    Point point;
-    Feature_Type type;
-  };
+void Map_Instance::read_row(int x, int y, int t_width, std::uint8_t *t_packed) const
+{
+  check_row(x, y, t_width);
 
-  std::vector<Map_Rendered_Terrain> terrains;
-  std::vector<Map_Rendered_Feature> features;
+  if (const std::uint8_t *row = dense_row(y))
+  {
+    std::copy(row + x, row + x + t_width, t_packed);
+    return;
+  }
 
-  Terrain_Type background;
-  double aspect_ratio;
+  const int chunk_size = m_chunks->chunk_size();
 
-  void add_terrain(Terrain_Type t_type, Location t_location, std::mt19937 &t_engine)
+  for (int column = x; column < x + t_width;)
   {
-    Shape shape(region().get_location(t_location), t_engine);
+    const int end = std::min(x + t_width, (column / chunk_size + 1) * chunk_size);
+    const std::shared_ptr<const std::vector<std::uint8_t>> chunk = read_chunk(column / chunk_size, y / chunk_size);
+    const std::uint8_t *chunk_row = chunk->data() + (y % chunk_size) * chunk_size;
 
-    terrains.push_back(Map_Rendered_Terrain(shape, t_type));
+    std::copy(chunk_row + column % chunk_size, chunk_row + column % chunk_size + (end - column), t_packed + (column - x));
+    column = end;
   }
+}
+
+void Map_Instance::write_row(int x, int y, int t_width, const std::uint8_t *t_packed)
+{
+  check_row(x, y, t_width);
 
-  void add_feature(Feature_Type t_type, Point t_p)
+  if (m_external_tiles)
   {
-    features.push_back(Map_Rendered_Feature(t_p, t_type));
+    chunk_external_tiles();
   }
 
-  Region region() const
+  if (std::uint8_t *row = writable_row(y))
   {
-    return Region(aspect_ratio, 1.0);
+    std::copy(t_packed, t_packed + t_width, row + x);
+    return;
   }
 
-  std::vector<std::pair<Point, Feature_Type>> map_features(double t_width, double t_height) const
+  const int chunk_size = m_chunks->chunk_size();
+
+  for (int column = x; column < x + t_width;)
   {
-    double region_width = region().width();
-    double region_height = region().height();
+    const int end = std::min(x + t_width, (column / chunk_size + 1) * chunk_size);
+    const std::shared_ptr<std::vector<std::uint8_t>> chunk = modify_chunk(column / chunk_size, y / chunk_size);
 
-    std::vector<std::pair<Point, Feature_Type>> retval;
+    std::copy(t_packed + (column - x), t_packed + (end - x), chunk->data() + (y % chunk_size) * chunk_size + column % chunk_size);
+    column = end;
+  }
+}
 
-    for (const Map_Rendered_Feature &feature: features)
-    {
-      retval.push_back(std::make_pair(Point(t_width * (feature.point.x / region_width), t_height * (feature.point.y / region_height)), feature.type));
-    }
+const std::uint8_t *Map_Instance::dense_row(int y) const
+{
+  if (m_chunks)
+  {
+    return nullptr;
+  }
 
-    return retval;
+  return (m_external_tiles ? m_external_tiles : m_tiles.data()) + size_t(y) * m_num_horizontal;
+}
+
+std::uint8_t *Map_Instance::writable_row(int y)
+{
+  if (m_chunks || m_external_tiles)
+  {
+    return nullptr;
   }
 
-  Map_Location at(double t_width, double t_height, Point t_p) const
+  return m_tiles.data() + size_t(y) * m_num_horizontal;
+}
+
+std::vector<Map_Instance::Map_Tile> Map_Instance::tiles(int x, int y, int t_width, int t_height) const
+{
+  if (t_width < 0 || t_height < 0 || x < 0 || y < 0 || x > m_num_horizontal - t_width || y > m_num_vertical - t_height)
   {
-    double region_width = region().width();
-    double region_height = region().height();
+    throw std::range_error("Outside of map range");
+  }
 
-    Point scaled_point(t_p.x / t_width * region_width, t_p.y / t_height * region_height);
+  std::vector<Map_Tile> result;
+  result.reserve(size_t(t_width) * t_height);
 
-    Map_Location loc;
-    loc.terrain = background;
-    loc.feature = None;
+  std::vector<std::uint8_t> row(t_width);
 
+  for (int row_y = y; row_y < y + t_height; ++row_y)
+  {
+    read_row(x, row_y, t_width, row.data());
 
-    for (auto itr = terrains.rbegin();
-        itr != terrains.rend();
-        ++itr)
+    for (std::uint8_t tile: row)
     {
-      if (itr->shape.contains(scaled_point))
-      {
-        loc.terrain = itr->type;
-        break;
-      }
+      result.push_back(unpack(tile));
     }
+  }
 
-    Region r(scaled_point, region_width / t_width, region_height / t_height);
-
+  return result;
+}
 
-    for (const auto &feature: features)
-    {
-      if (r.contains(feature.point))
+void Map_Instance::chunk_external_tiles()
+{
+  const std::shared_ptr<const void> owner = m_external_owner;
+  const std::uint8_t *tiles = m_external_tiles;
+  const int width = m_num_horizontal;
+  const int height = m_num_vertical;
+
+  // The chunks are read from the external tiles, which owner keeps alive,
+  // so only the chunks actually written to are ever copied.
+  m_chunks = std::make_shared<Map_Chunk_Cache>(external_chunk_size, Render_Options().max_cached_chunks,
+      [owner, tiles, width, height](int t_chunk_x, int t_chunk_y, Map_Chunk_Cache::Chunk &t_chunk)
       {
-        loc.feature = feature.type;
-        break;
-      }
-    }
+        const int first_x = t_chunk_x * external_chunk_size;
+        const int first_y = t_chunk_y * external_chunk_size;
+        const int columns = std::min(external_chunk_size, width - first_x);
+
+        for (int y = first_y; y < std::min(height, first_y + external_chunk_size); ++y)
+        {
+          const std::uint8_t *row = tiles + size_t(y) * width + first_x;
+          std::copy(row, row + columns, t_chunk.begin() + (y - first_y) * external_chunk_size);
+        }
+      });
+
+  m_external_tiles = nullptr;
+  m_external_owner.reset();
+}
 
-    return loc;
-  }
-};
+int Map_Instance::tile_width() const
+{
+  return m_tile_width;
+}
+
+int Map_Instance::tile_height() const
+{
+  return m_tile_height;
+}
+
+int Map_Instance::num_horizontal() const
+{
+  return m_num_horizontal;
+}
+
+int Map_Instance::num_vertical() const
+{
+  return m_num_vertical;
+}
 
+size_t Map_Instance::tile_storage_bytes() const
+{
+  return m_tiles.size();
+}
 
 
   Map::Map(Terrain_Type t_background)
@@ -174,32 +268,114 @@ void Map::add_map_feature(Map_Feature t_feature)
   m_features.push_back(t_feature);
 }
 
-Map_Instance Map::render(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, std::mt19937 &t_engine) const
+void Map::add_terrains(const std::vector<Map_Terrain> &t_terrains)
 {
-  Map_Rendered rendered_map(m_background, double(t_tile_width * t_num_horizontal) / double(t_tile_height * t_num_vertical));
-  render_terrain(rendered_map, t_engine);
-  render_features(rendered_map, t_engine);
-  return make_instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, rendered_map);
+  m_terrains.insert(m_terrains.end(), t_terrains.begin(), t_terrains.end());
 }
 
+void Map::add_map_features(const std::vector<Map_Feature> &t_features)
+{
+  m_features.insert(m_features.end(), t_features.begin(), t_features.end());
+}
 
-void Map::render_terrain(Map_Rendered &t_map, std::mt19937 &t_engine) const
+void Map::remove_terrain(size_t t_index)
 {
-  for (const auto &terrain: m_terrains)
+  if (t_index >= m_terrains.size())
   {
-    t_map.add_terrain(terrain.type, terrain.location, t_engine);
+    throw std::range_error("Terrain index out of range");
   }
+
+  m_terrains.erase(m_terrains.begin() + t_index);
+}
+
+void Map::remove_map_feature(size_t t_index)
+{
+  if (t_index >= m_features.size())
+  {
+    throw std::range_error("Feature index out of range");
+  }
+
+  m_features.erase(m_features.begin() + t_index);
+}
+
+Terrain_Type Map::background() const
+{
+  return m_background;
+}
+
+const std::vector<Map_Terrain> &Map::terrains() const
+{
+  return m_terrains;
 }
 
-void Map::render_features(Map_Rendered &t_map, std::mt19937 &t_engine) const
+const std::vector<Map_Feature> &Map::features() const
 {
-  std::vector<Map_Feature> features = m_features;
+  return m_features;
+}
 
-  std::map<Location, std::vector<Map_Feature>> features_by_location;
+Map_Instance Map::render(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, const Random_Stream &t_random,
+    const Render_Options &t_options) const
+{
+  std::shared_ptr<Map_Rendered> rendered_map = std::make_shared<Map_Rendered>(m_background,
+      double(t_tile_width * t_num_horizontal) / double(t_tile_height * t_num_vertical));
+  render_terrain(*rendered_map, t_random);
+  render_features(*rendered_map, t_random);
 
-  for (const auto &feature: m_features)
+  if (t_options.chunk_size > 0)
   {
-    features_by_location[feature.location].push_back(feature);
+    return make_chunked_instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, rendered_map, t_options);
+  } else {
+    return make_instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, *rendered_map, t_options);
+  }
+}
+
+
+void Map::render_terrain(Map_Rendered &t_map, const Random_Stream &t_random) const
+{
+  Scoped_Timer timer("Map::render_terrain");
+
+  for (size_t i = 0; i < m_terrains.size(); ++i)
+  {
+    t_map.add_terrain(m_terrains[i].type, m_terrains[i].location, t_random.split(Terrain_Random, i));
+  }
+}
+
+Terrain_Coverage Map::render_coverage(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+    const Random_Stream &t_random, const Render_Options &t_options) const
+{
+  Map_Rendered rendered_map(m_background, double(t_tile_width * t_num_horizontal) / double(t_tile_height * t_num_vertical));
+  render_terrain(rendered_map, t_random);
+
+  Terrain_Coverage coverage(t_num_horizontal, t_num_vertical, m_background);
+
+  Thread_Pool pool(t_options.num_threads);
+  const int num_bands = std::min(t_num_vertical, pool.num_threads() * 4);
+
+  pool.run(num_bands,
+      [&](int t_band)
+      {
+        std::vector<double> fractions;
+
+        for (int y = t_num_vertical * t_band / num_bands; y < t_num_vertical * (t_band + 1) / num_bands; ++y)
+        {
+          rendered_map.coverage_row(t_num_horizontal, t_num_vertical, y, fractions);
+          coverage.set_row(y, fractions.data());
+        }
+      }
+    );
+
+  return coverage;
+}
+
+void Map::render_features(Map_Rendered &t_map, const Random_Stream &t_random) const
+{
+  Scoped_Timer timer("Map::render_features");
+
+  std::map<Location, std::vector<size_t>> features_by_location;
+
+  for (size_t i = 0; i < m_features.size(); ++i)
+  {
+    features_by_location[m_features[i].location].push_back(i);
   }
 
   for (const auto &locationfeature: features_by_location)
@@ -211,42 +387,142 @@ void Map::render_features(Map_Rendered &t_map, std::mt19937 &t_engine) const
     int size = locationfeature.second.size();
 
     int griddivision = ceil(sqrt(size));
-    std::vector<Region> subregions = locationregion.subdivide(griddivision, griddivision);
+    const Region_Grid subregions = locationregion.subdivide(griddivision, griddivision);
 
-    std::random_shuffle(subregions.begin(), subregions.end(), 
-        [&](int i){ return std::uniform_int_distribution<>(0,i-1)(t_engine);  } );
+    // shuffle cell indices, the grid itself is computed on demand
+    std::vector<size_t> cells(subregions.size());
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+      cells[i] = i;
+    }
+
+    Random_Stream layout = t_random.split(Feature_Layout_Random, location);
+    std::random_shuffle(cells.begin(), cells.end(), 
+        [&](int i){ return std::uniform_int_distribution<>(0,i-1)(layout);  } );
 
     for (int i = 0; i < size; ++i)
     {
-      const Map_Feature &feature = locationfeature.second[i];
+      const size_t index = locationfeature.second[i];
 
-      Point p = subregions[i].choose_point(t_engine);
+      Random_Stream random = t_random.split(Feature_Random, index);
+      Point p = subregions[cells[i]].choose_point(random);
 
-      t_map.add_feature(feature.type, p);
+      t_map.add_feature(m_features[index].type, p);
     }
   }
 }
 
-Map_Instance Map::make_instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, Map_Rendered &t_map) const
+void Map::render_into(Map_Instance &t_target, int t_first_x, int t_first_y, int t_num_horizontal, int t_num_vertical,
+    const Random_Stream &t_random, const Render_Options &t_options) const
 {
+  if (t_num_horizontal < 0 || t_num_vertical < 0 || t_first_x < 0 || t_first_y < 0
+      || t_first_x > t_target.num_horizontal() - t_num_horizontal || t_first_y > t_target.num_vertical() - t_num_vertical)
+  {
+    throw std::range_error("Outside of map range");
+  }
+
+  // the bands write concurrently, which only rows of a dense target allow
+  if (!t_target.writable_row(t_first_y))
+  {
+    throw std::invalid_argument("Render target has to be a dense map");
+  }
+
+  Map_Rendered rendered_map(m_background,
+      double(t_target.tile_width() * t_num_horizontal) / double(t_target.tile_height() * t_num_vertical));
+  render_terrain(rendered_map, t_random);
+  render_features(rendered_map, t_random);
+
+  rasterize_into(t_target, t_first_x, t_first_y, t_num_horizontal, t_num_vertical, rendered_map, t_options);
+}
+
+Map_Instance Map::make_instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, const Map_Rendered &t_map,
+    const Render_Options &t_options) const
+{
+  Scoped_Timer timer("Map::make_instance");
 
   Map_Instance instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical);
 
-  for (int x = 0; x < t_num_horizontal; ++x)
-  {
-    for (int y = 0; y < t_num_vertical; ++y)
-    {
-      auto tile = t_map.at( t_num_horizontal, t_num_vertical, Point(x,y) );
+  rasterize_into(instance, 0, 0, t_num_horizontal, t_num_vertical, t_map, t_options);
 
-      instance.at(x, y).terrain_type = tile.terrain;
-      instance.at(x, y).feature_type = tile.feature;
-    }
+  return instance;
+}
+
+void Map::rasterize_into(Map_Instance &t_target, int t_first_x, int t_first_y, int t_num_horizontal, int t_num_vertical,
+    const Map_Rendered &t_map, const Render_Options &t_options) const
+{
+  Thread_Pool pool(t_options.num_threads);
+
+  Map_Rendered::Feature_Rows feature_rows;
+  if (t_options.rasterizer == Scanline_Rasterizer)
+  {
+    feature_rows = t_map.bin_features(t_num_horizontal, t_num_vertical);
   }
 
-  return instance;
+  // Several bands per thread so uneven bands balance out. Every tile only
+  // depends on t_map, so the result does not depend on the band layout.
+  const int num_bands = std::min(t_num_vertical, pool.num_threads() * 4);
 
+  // Tiles come row by row, each band writes its rows of the target in place
+  pool.run(num_bands,
+      [&](int t_band)
+      {
+        int row_y = -1;
+        std::uint8_t *row = nullptr;
+
+        t_map.rasterize(t_options.rasterizer, feature_rows, t_num_horizontal, t_num_vertical,
+            0, t_num_horizontal, t_num_vertical * t_band / num_bands, t_num_vertical * (t_band + 1) / num_bands,
+            [&](int t_x, int t_y, const Map_Instance::Map_Tile &t_tile)
+            {
+              if (t_y != row_y)
+              {
+                row_y = t_y;
+                row = t_target.writable_row(t_first_y + t_y);
+              }
+
+              if (row)
+              {
+                row[t_first_x + t_x] = Map_Instance::pack(t_tile);
+              } else {
+                t_target.set(t_first_x + t_x, t_first_y + t_y, t_tile);
+              }
+            }
+          );
+      }
+    );
 }
 
 
 
+Map_Instance Map::make_chunked_instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+    const std::shared_ptr<const Map_Rendered> &t_map, const Render_Options &t_options) const
+{
+  // bin the features up front, it is cheap and keeps chunk generation
+  // proportional to the chunk area
+  auto feature_rows = std::make_shared<Map_Rendered::Feature_Rows>();
+  if (t_options.rasterizer == Scanline_Rasterizer)
+  {
+    *feature_rows = t_map->bin_features(t_num_horizontal, t_num_vertical);
+  }
+
+  const int chunk_size = t_options.chunk_size;
+  const Rasterizer rasterizer = t_options.rasterizer;
+
+  std::shared_ptr<Map_Chunk_Cache> chunks = std::make_shared<Map_Chunk_Cache>(chunk_size, t_options.max_cached_chunks,
+      [=](int t_chunk_x, int t_chunk_y, Map_Chunk_Cache::Chunk &t_chunk)
+      {
+        const int first_x = t_chunk_x * chunk_size;
+        const int first_y = t_chunk_y * chunk_size;
+
+        t_map->rasterize(rasterizer, *feature_rows, t_num_horizontal, t_num_vertical,
+            first_x, std::min(first_x + chunk_size, t_num_horizontal), first_y, std::min(first_y + chunk_size, t_num_vertical),
+            [&](int t_x, int t_y, const Map_Instance::Map_Tile &t_tile)
+            {
+              t_chunk[(t_y - first_y) * chunk_size + (t_x - first_x)] = Map_Instance::pack(t_tile);
+            }
+          );
+      }
+    );
+
+  return Map_Instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, chunks);
+}
 
@@ -5,9 +5,12 @@
 #include "Region.hpp"
 
 #include <algorithm>
+#include <cstdint>
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <stdexcept>
 
 enum Terrain_Type
 {
@@ -49,6 +52,21 @@ struct Map_Location
 };
 
 
+/// Block of tiles, in tile coordinates, that changed
+struct Dirty_Rect
+{
+  Dirty_Rect(int t_x, int t_y, int t_width, int t_height);
+
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+class Map_Chunk_Cache;
+class Map_Written_Chunk;
+class Terrain_Coverage;
+
 class Map_Instance
 {
   public:
@@ -58,16 +76,109 @@ class Map_Instance
       Feature_Type feature_type;
     };
 
+    /// Tiles are stored one byte each, the terrain in the low and the feature
+    /// in the high nibble.
+    static std::uint8_t pack(const Map_Tile &t_tile)
+    {
+      return std::uint8_t(t_tile.terrain_type | (t_tile.feature_type << 4));
+    }
+
+    static Map_Tile unpack(std::uint8_t t_tile)
+    {
+      Map_Tile tile;
+      tile.terrain_type = Terrain_Type(t_tile & 0x0F);
+      tile.feature_type = Feature_Type(t_tile >> 4);
+      return tile;
+    }
+
     Map_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical);
 
-    const Map_Tile &at(int x, int y) const;
+    /// Lazily generated map. Tiles are read from t_chunks, which generates
+    /// them chunk by chunk on first access and may drop cold chunks again.
+    /// A chunk written to through this instance is copied into t_chunks as a
+    /// written chunk, which is evicted to disk rather than dropped, so memory
+    /// stays bounded however much of the map is changed. Copies of the
+    /// instance share written chunks until one side writes again.
+    Map_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+        const std::shared_ptr<Map_Chunk_Cache> &t_chunks);
+
+    /// Map served straight from read only, externally owned packed tiles, such
+    /// as a memory mapped file. t_owner keeps t_tiles alive and is shared by
+    /// all copies of the instance. The first write turns the instance into a
+    /// chunked one whose chunks are generated from t_tiles, so only the
+    /// chunks written to are copied.
+    Map_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+        const std::shared_ptr<const void> &t_owner, const std::uint8_t *t_tiles);
+
+    Map_Tile at(int x, int y) const
+    {
+      if (x >= m_num_horizontal || y >= m_num_vertical || x < 0 || y < 0)
+      {
+        throw std::range_error("Outside of map range");
+      }
+
+      // dense maps are read inline, this sits in the inner loop of every scan
+      if (!m_chunks)
+      {
+        return unpack((m_external_tiles ? m_external_tiles : m_tiles.data())[size_t(y) * m_num_horizontal + x]);
+      }
+
+      return chunk_at(x, y);
+    }
+
+    void set(int x, int y, const Map_Tile &t_tile);
+
+    /// Tiles of columns [x, x + t_width) of rows [y, y + t_height), row by
+    /// row. Throws std::range_error unless the whole block is on the map.
+    std::vector<Map_Tile> tiles(int x, int y, int t_width, int t_height) const;
+
+    /// Copies the packed tiles of columns [x, x + t_width) of row y to
+    /// t_packed. Bulk readers should prefer this to at(), which looks up the
+    /// chunk of every tile on its own. Throws std::range_error unless the
+    /// whole span is on the map.
+    void read_row(int x, int y, int t_width, std::uint8_t *t_packed) const;
 
+    /// Overwrites columns [x, x + t_width) of row y with packed tiles
+    void write_row(int x, int y, int t_width, const std::uint8_t *t_packed);
+
+    /// Packed tiles of row y where the map is held in one piece, so they
+    /// can be read in place, nullptr for chunked maps
+    const std::uint8_t *dense_row(int y) const;
+
+    /// Same for writing in place, nullptr unless the map is dense and owns
+    /// its tiles. Distinct rows may be written concurrently.
+    std::uint8_t *writable_row(int y);
+
+    int tile_width() const;
+    int tile_height() const;
     int num_horizontal() const;
     int num_vertical() const;
-    Map_Tile &at(int x, int y);
+
+    /// Bytes of tile data owned by this instance. Chunks, written or not,
+    /// are held by the shared chunk cache and not counted.
+    size_t tile_storage_bytes() const;
 
   private:
-    std::vector<Map_Tile> m_tiles;
+    Map_Tile chunk_at(int x, int y) const;
+    void check_row(int x, int y, int t_width) const;
+
+    /// Moves externally owned tiles into a chunk cache generating from them
+    void chunk_external_tiles();
+
+    /// Tiles of chunk (t_chunk_x, t_chunk_y) as seen by this instance
+    std::shared_ptr<const std::vector<std::uint8_t>> read_chunk(int t_chunk_x, int t_chunk_y) const;
+
+    /// Tiles of chunk (t_chunk_x, t_chunk_y) to change in place, made a
+    /// written chunk of this instance alone first
+    std::shared_ptr<std::vector<std::uint8_t>> modify_chunk(int t_chunk_x, int t_chunk_y);
+
+    std::vector<std::uint8_t> m_tiles;
+
+    std::shared_ptr<const void> m_external_owner;
+    const std::uint8_t *m_external_tiles;
+
+    std::shared_ptr<Map_Chunk_Cache> m_chunks;
+    std::map<std::pair<int, int>, std::shared_ptr<Map_Written_Chunk>> m_written_chunks;
 
     int m_tile_width;
     int m_tile_height;
@@ -76,6 +187,22 @@ class Map_Instance
 
 };
 
+enum Rasterizer
+{
+  Scanline_Rasterizer,   //< fills the row spans each shape covers, cost scales with shape perimeter
+  Point_Query_Rasterizer //< tests every tile against every shape, kept to validate the scanline path with worldbuilder_bench --validate
+};
+
+struct Render_Options
+{
+  Render_Options();
+
+  int num_threads; //< threads rasterizing tiles, 1 keeps all work on the calling thread
+  Rasterizer rasterizer;
+  int chunk_size; //< 0 rasterizes the whole map up front, otherwise tiles are generated in square chunks on first access
+  size_t max_cached_chunks; //< chunks kept in memory before the least recently used are dropped, or written to disk if changed
+};
+
 class Map
 {
   public:
@@ -85,19 +212,63 @@ class Map
 
     void add_map_feature(Map_Feature t_feature);
 
-    Map_Instance render(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, std::mt19937 &t_engine) const;
+    /// Same as calling add_terrain() / add_map_feature() for each element, in order
+    void add_terrains(const std::vector<Map_Terrain> &t_terrains);
+    void add_map_features(const std::vector<Map_Feature> &t_features);
 
-  private:
+    /// Throws std::range_error if there is no terrain t_index
+    void remove_terrain(size_t t_index);
+
+    /// Throws std::range_error if there is no feature t_index
+    void remove_map_feature(size_t t_index);
+
+    Terrain_Type background() const;
+    const std::vector<Map_Terrain> &terrains() const;
+    const std::vector<Map_Feature> &features() const;
+
+    /// Every terrain and feature draws from its own stream split off
+    /// t_random, see Random_Stream. The same t_random always gives the same map.
+    Map_Instance render(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, const Random_Stream &t_random,
+        const Render_Options &t_options = Render_Options()) const;
+
+    /// Renders this map into the t_num_horizontal x t_num_vertical block of
+    /// t_target starting at tile (t_first_x, t_first_y), as if it were a map
+    /// of its own. t_target has to be a dense instance that owns its tiles,
+    /// otherwise std::invalid_argument is thrown, and the block has to be on
+    /// it, otherwise std::range_error is thrown. Tiles outside the
+    /// block are not touched, so maps can render into disjoint blocks of the
+    /// same target concurrently.
+    void render_into(Map_Instance &t_target, int t_first_x, int t_first_y, int t_num_horizontal, int t_num_vertical,
+        const Random_Stream &t_random, const Render_Options &t_options = Render_Options()) const;
+
+    /// How much of every tile each terrain covers, with the same shapes render() places for
+    /// t_random. Each terrain's coverage comes from the exact intersection
+    /// area of its circles with the tile and is painted over the terrains
+    /// added before it, so it costs about one pass over the tiles however
+    /// finely the borders are resolved. Defined in Terrain_Coverage.hpp.
+    Terrain_Coverage render_coverage(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+        const Random_Stream &t_random, const Render_Options &t_options = Render_Options()) const;
+
+    /// The stages of render(), public so they can be benchmarked on their own.
+    /// Map_Rendered is defined in Map_Rendered.hpp.
     struct Map_Rendered;
+    void render_terrain(Map_Rendered &t_map, const Random_Stream &t_random) const;
+    void render_features(Map_Rendered &t_map, const Random_Stream &t_random) const;
+
+    Map_Instance make_instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, const Map_Rendered &t_map,
+        const Render_Options &t_options) const;
+
+  private:
     Terrain_Type m_background;
     std::vector<Map_Terrain> m_terrains;
     std::vector<Map_Feature> m_features;
     int m_seed;
 
-    void render_terrain(Map_Rendered &t_map, std::mt19937 &t_engine) const;
-    void render_features(Map_Rendered &t_map, std::mt19937 &t_engine) const;
+    void rasterize_into(Map_Instance &t_target, int t_first_x, int t_first_y, int t_num_horizontal, int t_num_vertical,
+        const Map_Rendered &t_map, const Render_Options &t_options) const;
 
-    Map_Instance make_instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, Map_Rendered &t_map) const;
+    Map_Instance make_chunked_instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+        const std::shared_ptr<const Map_Rendered> &t_map, const Render_Options &t_options) const;
 };
 
 
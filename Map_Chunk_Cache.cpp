@@ -0,0 +1,251 @@
+#include "Map_Chunk_Cache.hpp"
+
+#include <stdexcept>
+
+Map_Written_Chunk::Map_Written_Chunk(const std::shared_ptr<Map_Chunk_Cache> &t_cache, std::uint64_t t_id)
+  : m_cache(t_cache), m_id(t_id)
+{
+}
+
+Map_Written_Chunk::~Map_Written_Chunk()
+{
+  m_cache->release(m_id);
+}
+
+Map_Chunk_Cache::Entry::Entry()
+  : dirty(false), slot(-1)
+{
+}
+
+Map_Chunk_Cache::Map_Chunk_Cache(int t_chunk_size, size_t t_capacity, const Generator &t_generator)
+  : m_chunk_size(t_chunk_size), m_capacity(std::max(size_t(1), t_capacity)), m_generator(t_generator), m_num_generated(0),
+    m_next_id(1), m_spill_file(nullptr), m_num_slots(0)
+{
+}
+
+Map_Chunk_Cache::~Map_Chunk_Cache()
+{
+  if (m_spill_file)
+  {
+    std::fclose(m_spill_file);
+  }
+}
+
+int Map_Chunk_Cache::chunk_size() const
+{
+  return m_chunk_size;
+}
+
+std::shared_ptr<const Map_Chunk_Cache::Chunk> Map_Chunk_Cache::get(int t_chunk_x, int t_chunk_y)
+{
+  const Key key(0, t_chunk_x, t_chunk_y);
+
+  {
+    std::unique_lock<std::mutex> l(m_mutex);
+
+    auto itr = m_chunks.find(key);
+    if (itr != m_chunks.end())
+    {
+      m_lru.splice(m_lru.begin(), m_lru, itr->second.lru);
+      return itr->second.tiles;
+    }
+  }
+
+  // generate without holding the lock so other chunks can be served meanwhile
+  std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>(m_chunk_size * m_chunk_size);
+  m_generator(t_chunk_x, t_chunk_y, *chunk);
+
+  std::unique_lock<std::mutex> l(m_mutex);
+
+  ++m_num_generated;
+
+  auto itr = m_chunks.find(key);
+  if (itr != m_chunks.end())
+  {
+    // another thread generated the same chunk in the meantime
+    m_lru.splice(m_lru.begin(), m_lru, itr->second.lru);
+    return itr->second.tiles;
+  }
+
+  Entry &entry = m_chunks[key];
+  entry.tiles = chunk;
+  m_lru.push_front(key);
+  entry.lru = m_lru.begin();
+
+  evict();
+
+  return chunk;
+}
+
+std::shared_ptr<Map_Written_Chunk> Map_Chunk_Cache::write(const Chunk &t_tiles)
+{
+  std::shared_ptr<Chunk> tiles = std::make_shared<Chunk>(t_tiles);
+
+  std::unique_lock<std::mutex> l(m_mutex);
+
+  const std::uint64_t id = m_next_id++;
+  const Key key(id, 0, 0);
+
+  Entry &entry = m_chunks[key];
+  entry.tiles = tiles;
+  entry.dirty = true;
+  m_lru.push_front(key);
+  entry.lru = m_lru.begin();
+
+  evict();
+
+  return std::shared_ptr<Map_Written_Chunk>(new Map_Written_Chunk(shared_from_this(), id));
+}
+
+std::shared_ptr<const Map_Chunk_Cache::Chunk> Map_Chunk_Cache::read(const Map_Written_Chunk &t_chunk)
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  return load(Key(t_chunk.m_id, 0, 0));
+}
+
+std::shared_ptr<Map_Chunk_Cache::Chunk> Map_Chunk_Cache::modify(const Map_Written_Chunk &t_chunk)
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+
+  const Key key(t_chunk.m_id, 0, 0);
+  std::shared_ptr<Chunk> tiles = load(key);
+  m_chunks[key].dirty = true;
+  return tiles;
+}
+
+void Map_Chunk_Cache::release(std::uint64_t t_id)
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+
+  auto itr = m_chunks.find(Key(t_id, 0, 0));
+  if (itr == m_chunks.end())
+  {
+    return;
+  }
+
+  if (itr->second.tiles)
+  {
+    m_lru.erase(itr->second.lru);
+  }
+
+  if (itr->second.slot >= 0)
+  {
+    m_free_slots.push_back(itr->second.slot);
+  }
+
+  m_chunks.erase(itr);
+}
+
+std::shared_ptr<Map_Chunk_Cache::Chunk> Map_Chunk_Cache::load(const Key &t_key)
+{
+  Entry &entry = m_chunks.at(t_key);
+
+  if (entry.tiles)
+  {
+    m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+    return entry.tiles;
+  }
+
+  std::shared_ptr<Chunk> tiles = std::make_shared<Chunk>(m_chunk_size * m_chunk_size);
+
+  if (std::fseek(m_spill_file, entry.slot * long(tiles->size()), SEEK_SET) != 0
+      || std::fread(tiles->data(), 1, tiles->size(), m_spill_file) != tiles->size())
+  {
+    throw std::runtime_error("Unable to read back evicted map chunk");
+  }
+
+  entry.tiles = tiles;
+  entry.dirty = false;
+  m_lru.push_front(t_key);
+  entry.lru = m_lru.begin();
+
+  evict();
+
+  return tiles;
+}
+
+void Map_Chunk_Cache::evict()
+{
+  auto itr = m_lru.end();
+
+  while (m_lru.size() > m_capacity && itr != m_lru.begin())
+  {
+    --itr;
+
+    const Key key = *itr;
+    auto chunk = m_chunks.find(key);
+    Entry &entry = chunk->second;
+
+    if (std::get<0>(key) != 0)
+    {
+      // someone is reading or changing it right now
+      if (!entry.tiles.unique())
+      {
+        continue;
+      }
+
+      if (entry.dirty)
+      {
+        spill(entry);
+      }
+
+      entry.tiles.reset();
+    } else {
+      m_chunks.erase(chunk);
+    }
+
+    itr = m_lru.erase(itr);
+  }
+}
+
+void Map_Chunk_Cache::spill(Entry &t_entry)
+{
+  if (!m_spill_file)
+  {
+    m_spill_file = std::tmpfile();
+
+    if (!m_spill_file)
+    {
+      throw std::runtime_error("Unable to create temporary file for evicted map chunks");
+    }
+  }
+
+  if (t_entry.slot < 0)
+  {
+    if (m_free_slots.empty())
+    {
+      t_entry.slot = m_num_slots++;
+    } else {
+      t_entry.slot = m_free_slots.back();
+      m_free_slots.pop_back();
+    }
+  }
+
+  const Chunk &tiles = *t_entry.tiles;
+
+  if (std::fseek(m_spill_file, t_entry.slot * long(tiles.size()), SEEK_SET) != 0
+      || std::fwrite(tiles.data(), 1, tiles.size(), m_spill_file) != tiles.size())
+  {
+    throw std::runtime_error("Unable to write evicted map chunk");
+  }
+
+  t_entry.dirty = false;
+}
+
+size_t Map_Chunk_Cache::num_cached() const
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  return m_lru.size();
+}
+
+size_t Map_Chunk_Cache::num_generated() const
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  return m_num_generated;
+}
+
+size_t Map_Chunk_Cache::num_spilled() const
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  return m_chunks.size() - m_lru.size();
+}
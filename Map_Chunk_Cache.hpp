@@ -0,0 +1,125 @@
+#ifndef WORLDBUILDER_MAP_CHUNK_CACHE_HPP
+#define WORLDBUILDER_MAP_CHUNK_CACHE_HPP
+
+#include "Map.hpp"
+
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+class Map_Chunk_Cache;
+
+/// Handle to a chunk written through a Map_Instance, see
+/// Map_Chunk_Cache::write(). The tiles are released once the last handle
+/// goes away.
+class Map_Written_Chunk
+{
+  public:
+    ~Map_Written_Chunk();
+
+    Map_Written_Chunk(const Map_Written_Chunk &) = delete;
+    Map_Written_Chunk &operator=(const Map_Written_Chunk &) = delete;
+
+  private:
+    friend class Map_Chunk_Cache;
+
+    Map_Written_Chunk(const std::shared_ptr<Map_Chunk_Cache> &t_cache, std::uint64_t t_id);
+
+    std::shared_ptr<Map_Chunk_Cache> m_cache;
+    std::uint64_t m_id;
+};
+
+/// Bounded, thread safe store of square map chunks.
+///
+/// Generated chunks are produced on first access. Once more than the capacity
+/// are held in memory the least recently used are dropped and generated again
+/// on their next access, so the generator has to be a pure function of the
+/// chunk coordinates.
+///
+/// Written chunks, the ones a Map_Instance has changed, count towards the same
+/// capacity. They cannot be generated again, so when evicted they are written
+/// to a temporary file and read back on their next access.
+class Map_Chunk_Cache : public std::enable_shared_from_this<Map_Chunk_Cache>
+{
+  public:
+    /// row major, chunk_size * chunk_size tiles packed with Map_Instance::pack(),
+    /// tiles past the map edge are unused
+    typedef std::vector<std::uint8_t> Chunk;
+    typedef std::function<void (int t_chunk_x, int t_chunk_y, Chunk &t_chunk)> Generator;
+
+    Map_Chunk_Cache(int t_chunk_size, size_t t_capacity, const Generator &t_generator);
+    ~Map_Chunk_Cache();
+
+    Map_Chunk_Cache(const Map_Chunk_Cache &) = delete;
+    Map_Chunk_Cache &operator=(const Map_Chunk_Cache &) = delete;
+
+    int chunk_size() const;
+
+    /// The chunk stays valid for as long as the caller holds on to it, even
+    /// if the cache drops it in the meantime.
+    std::shared_ptr<const Chunk> get(int t_chunk_x, int t_chunk_y);
+
+    /// New written chunk starting out as a copy of t_tiles. The cache has
+    /// to be owned by a std::shared_ptr.
+    std::shared_ptr<Map_Written_Chunk> write(const Chunk &t_tiles);
+
+    /// Tiles of t_chunk, read back from disk if they were evicted. Like
+    /// get(), they stay valid for as long as the caller holds on to them.
+    std::shared_ptr<const Chunk> read(const Map_Written_Chunk &t_chunk);
+
+    /// Tiles of t_chunk to change in place. Only for the sole holder of
+    /// t_chunk, which has to let go of the result before reading or
+    /// modifying t_chunk again. The tiles are not evicted while held.
+    /// Throws std::runtime_error if the temporary file cannot be written.
+    std::shared_ptr<Chunk> modify(const Map_Written_Chunk &t_chunk);
+
+    /// Chunks held in memory, generated and written
+    size_t num_cached() const;
+    size_t num_generated() const;
+    /// Written chunks held only in the temporary file
+    size_t num_spilled() const;
+
+  private:
+    friend class Map_Written_Chunk;
+
+    /// written chunk id, 0 for generated chunks, and the chunk coordinates of
+    /// generated chunks
+    typedef std::tuple<std::uint64_t, int, int> Key;
+
+    struct Entry
+    {
+      Entry();
+
+      std::shared_ptr<Chunk> tiles; //< null while only in the temporary file
+      std::list<Key>::iterator lru; //< valid while tiles is held
+      bool dirty; //< changed since last written to the temporary file
+      long slot; //< chunk sized slot in the temporary file, -1 if never written there
+    };
+
+    void release(std::uint64_t t_id);
+
+    /// The following expect m_mutex to be held
+    std::shared_ptr<Chunk> load(const Key &t_key);
+    void evict();
+    void spill(Entry &t_entry);
+
+    int m_chunk_size;
+    size_t m_capacity;
+    Generator m_generator;
+
+    mutable std::mutex m_mutex;
+    std::list<Key> m_lru; //< chunks held in memory, most recently used first
+    std::map<Key, Entry> m_chunks;
+    size_t m_num_generated;
+    std::uint64_t m_next_id;
+
+    std::FILE *m_spill_file; //< opened on first use
+    long m_num_slots;
+    std::vector<long> m_free_slots;
+};
+
+#endif
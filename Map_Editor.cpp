@@ -0,0 +1,159 @@
+#include "Map_Editor.hpp"
+#include "Map_Rendered.hpp"
+
+#include <stdexcept>
+
+Map_Editor::Map_Editor(const Map &t_map, int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+    const Random_Stream &t_random, const Render_Options &t_options)
+  : m_map(t_map), m_random(t_random), m_next_terrain_index(t_map.terrains().size()), m_next_feature_index(t_map.features().size()),
+    m_options(t_options),
+    m_rendered(new Map::Map_Rendered(t_map.background(), double(t_tile_width * t_num_horizontal) / double(t_tile_height * t_num_vertical))),
+    m_instance(t_tile_width, t_tile_height, 0, 0)
+{
+  m_options.chunk_size = 0;
+
+  m_map.render_terrain(*m_rendered, m_random);
+  m_map.render_features(*m_rendered, m_random);
+
+  m_instance = m_map.make_instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, *m_rendered, m_options);
+  m_feature_rows = m_rendered->bin_features(t_num_horizontal, t_num_vertical);
+
+  // render_features() places features grouped by location, in Location order
+  std::map<Location, std::vector<size_t>> features_by_location;
+  for (size_t i = 0; i < m_map.features().size(); ++i)
+  {
+    features_by_location[m_map.features()[i].location].push_back(i);
+  }
+
+  m_feature_slots.resize(m_map.features().size());
+  size_t rendered_index = 0;
+  for (const auto &location: features_by_location)
+  {
+    for (size_t feature: location.second)
+    {
+      m_feature_slots[feature] = rendered_index++;
+    }
+  }
+}
+
+Map_Editor::~Map_Editor()
+{
+}
+
+const Map &Map_Editor::map() const
+{
+  return m_map;
+}
+
+const Map_Instance &Map_Editor::instance() const
+{
+  return m_instance;
+}
+
+std::vector<Dirty_Rect> Map_Editor::add_terrain(const Map_Terrain &t_terrain)
+{
+  m_map.add_terrain(t_terrain);
+  m_rendered->add_terrain(t_terrain.type, t_terrain.location, m_random.split(Terrain_Random, m_next_terrain_index++));
+
+  const Dirty_Rect rect = terrain_rect(m_rendered->terrains.size() - 1);
+  rerender(rect);
+  return std::vector<Dirty_Rect>(1, rect);
+}
+
+std::vector<Dirty_Rect> Map_Editor::remove_terrain(size_t t_index)
+{
+  if (t_index >= m_map.terrains().size())
+  {
+    throw std::range_error("Terrain index out of range");
+  }
+
+  const Dirty_Rect rect = terrain_rect(t_index);
+
+  m_map.remove_terrain(t_index);
+  m_rendered->terrains.erase(m_rendered->terrains.begin() + t_index);
+
+  rerender(rect);
+  return std::vector<Dirty_Rect>(1, rect);
+}
+
+std::vector<Dirty_Rect> Map_Editor::add_map_feature(const Map_Feature &t_feature)
+{
+  m_map.add_map_feature(t_feature);
+  Random_Stream random = m_random.split(Feature_Random, m_next_feature_index++);
+  m_rendered->add_feature(t_feature.type, m_rendered->region().get_location(t_feature.location).choose_point(random));
+  m_feature_slots.push_back(m_rendered->features.size() - 1);
+
+  const Dirty_Rect rect = feature_rect(m_rendered->features.size() - 1);
+  rerender(rect);
+  return std::vector<Dirty_Rect>(1, rect);
+}
+
+std::vector<Dirty_Rect> Map_Editor::remove_map_feature(size_t t_index)
+{
+  if (t_index >= m_map.features().size())
+  {
+    throw std::range_error("Feature index out of range");
+  }
+
+  const size_t rendered_index = m_feature_slots[t_index];
+  const Dirty_Rect rect = feature_rect(rendered_index);
+
+  m_map.remove_map_feature(t_index);
+  m_rendered->features.erase(m_rendered->features.begin() + rendered_index);
+
+  m_feature_slots.erase(m_feature_slots.begin() + t_index);
+  for (auto &slot: m_feature_slots)
+  {
+    if (slot > rendered_index)
+    {
+      --slot;
+    }
+  }
+
+  rerender(rect);
+  return std::vector<Dirty_Rect>(1, rect);
+}
+
+Dirty_Rect Map_Editor::terrain_rect(size_t t_index) const
+{
+  const Region bounds = m_rendered->terrains.at(t_index).shape.bounding_box();
+
+  const double columns_per_unit = m_instance.num_horizontal() / m_rendered->region().width();
+  const double rows_per_unit = m_instance.num_vertical() / m_rendered->region().height();
+
+  // one tile of slack on every side absorbs rounding of the sample points
+  const int first_x = std::max(0, int(std::floor(bounds.top_left().x * columns_per_unit)) - 1);
+  const int first_y = std::max(0, int(std::floor(bounds.top_left().y * rows_per_unit)) - 1);
+  const int end_x = std::min(m_instance.num_horizontal(), int(std::ceil(bounds.bottom_right().x * columns_per_unit)) + 2);
+  const int end_y = std::min(m_instance.num_vertical(), int(std::ceil(bounds.bottom_right().y * rows_per_unit)) + 2);
+
+  return Dirty_Rect(first_x, first_y, std::max(0, end_x - first_x), std::max(0, end_y - first_y));
+}
+
+Dirty_Rect Map_Editor::feature_rect(size_t t_rendered_index) const
+{
+  const Point &p = m_rendered->features.at(t_rendered_index).point;
+
+  const int column = int(std::floor(p.x * m_instance.num_horizontal() / m_rendered->region().width()));
+  const int row = int(std::floor(p.y * m_instance.num_vertical() / m_rendered->region().height()));
+
+  // a point on a tile edge belongs to both neighbours, see bin_features()
+  const int first_x = std::max(0, column - 1);
+  const int first_y = std::max(0, row - 1);
+  const int end_x = std::min(m_instance.num_horizontal(), column + 2);
+  const int end_y = std::min(m_instance.num_vertical(), row + 2);
+
+  return Dirty_Rect(first_x, first_y, std::max(0, end_x - first_x), std::max(0, end_y - first_y));
+}
+
+void Map_Editor::rerender(const Dirty_Rect &t_rect)
+{
+  const int width = m_instance.num_horizontal();
+  const int height = m_instance.num_vertical();
+
+  m_rendered->bin_features(width, height, t_rect.y, t_rect.y + t_rect.height, m_feature_rows);
+
+  m_rendered->rasterize(m_options.rasterizer, m_feature_rows, width, height,
+      t_rect.x, t_rect.x + t_rect.width, t_rect.y, t_rect.y + t_rect.height,
+      [&](int t_x, int t_y, const Map_Instance::Map_Tile &t_tile) { m_instance.set(t_x, t_y, t_tile); });
+}
@@ -0,0 +1,60 @@
+#ifndef WORLDBUILDER_MAP_EDITOR_HPP
+#define WORLDBUILDER_MAP_EDITOR_HPP
+
+#include "Map.hpp"
+
+#include <memory>
+#include <vector>
+
+/// A rendered map whose definition can still change. Adding or removing a
+/// terrain re-rasterizes only the tiles under the bounding box of its shape,
+/// adding or removing a feature only the tiles around its point. Every edit
+/// returns the rectangles it touched, so consumers holding a copy of the map
+/// can refresh just those.
+///
+/// A terrain added here gets the shape a full render would give it at the
+/// index it was added at. Indices are never handed out twice, so after a
+/// removal later additions draw fresh shapes instead of repeating a removed
+/// one. A feature added here is placed anywhere in its location instead of
+/// in its own cell of the location grid, so that the existing features do
+/// not move.
+///
+/// Always renders densely, Render_Options::chunk_size is ignored.
+class Map_Editor
+{
+  public:
+    Map_Editor(const Map &t_map, int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical,
+        const Random_Stream &t_random, const Render_Options &t_options = Render_Options());
+    ~Map_Editor();
+
+    Map_Editor(const Map_Editor &) = delete;
+    Map_Editor &operator=(const Map_Editor &) = delete;
+
+    const Map &map() const;
+    const Map_Instance &instance() const;
+
+    std::vector<Dirty_Rect> add_terrain(const Map_Terrain &t_terrain);
+    std::vector<Dirty_Rect> add_map_feature(const Map_Feature &t_feature);
+
+    /// \param t_index position in Map::terrains() / Map::features(), throws
+    ///                std::range_error if there is none
+    std::vector<Dirty_Rect> remove_terrain(size_t t_index);
+    std::vector<Dirty_Rect> remove_map_feature(size_t t_index);
+
+  private:
+    Dirty_Rect terrain_rect(size_t t_index) const;
+    Dirty_Rect feature_rect(size_t t_rendered_index) const;
+    void rerender(const Dirty_Rect &t_rect);
+
+    Map m_map;
+    Random_Stream m_random;
+    size_t m_next_terrain_index; //< stream index for the next added terrain
+    size_t m_next_feature_index; //< stream index for the next added feature
+    Render_Options m_options;
+    std::unique_ptr<Map::Map_Rendered> m_rendered;
+    std::vector<std::vector<std::pair<int, Feature_Type>>> m_feature_rows; //< Map::Map_Rendered::Feature_Rows
+    std::vector<size_t> m_feature_slots; //< index into the rendered features for every feature of m_map
+    Map_Instance m_instance;
+};
+
+#endif
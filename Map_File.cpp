@@ -0,0 +1,233 @@
+#include "Map_File.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  const char magic[8] = { 'W', 'B', 'M', 'A', 'P', 0, 0, 0 };
+
+  void put(std::uint8_t *t_data, std::uint64_t t_value, int t_bytes)
+  {
+    for (int i = 0; i < t_bytes; ++i)
+    {
+      t_data[i] = std::uint8_t(t_value >> (8 * i));
+    }
+  }
+
+  std::uint64_t get(const std::uint8_t *t_data, int t_bytes)
+  {
+    std::uint64_t value = 0;
+    for (int i = 0; i < t_bytes; ++i)
+    {
+      value |= std::uint64_t(t_data[i]) << (8 * i);
+    }
+    return value;
+  }
+
+  /// Read only mapping of a whole file, unmapped on destruction
+  class Mapped_File
+  {
+    public:
+      explicit Mapped_File(const std::string &t_filename)
+        : m_data(nullptr), m_size(0)
+      {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(t_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+          throw std::runtime_error("Unable to open map file: " + t_filename);
+        }
+
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        m_size = size_t(size.QuadPart);
+
+        HANDLE mapping = m_size ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        CloseHandle(file);
+
+        if (mapping)
+        {
+          m_data = static_cast<const std::uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+          CloseHandle(mapping);
+        }
+#else
+        int fd = open(t_filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+          throw std::runtime_error("Unable to open map file: " + t_filename);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+          m_size = size_t(st.st_size);
+          void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          m_data = data == MAP_FAILED ? nullptr : static_cast<const std::uint8_t *>(data);
+        }
+
+        close(fd);
+#endif
+
+        if (!m_data)
+        {
+          throw std::runtime_error("Unable to map map file: " + t_filename);
+        }
+      }
+
+      ~Mapped_File()
+      {
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap(const_cast<std::uint8_t *>(m_data), m_size);
+#endif
+      }
+
+      Mapped_File(const Mapped_File &) = delete;
+      Mapped_File &operator=(const Mapped_File &) = delete;
+
+      const std::uint8_t *data() const
+      {
+        return m_data;
+      }
+
+      size_t size() const
+      {
+        return m_size;
+      }
+
+    private:
+      const std::uint8_t *m_data;
+      size_t m_size;
+  };
+}
+
+Map_File::Header::Header()
+  : version(Map_File::version), tile_width(0), tile_height(0), num_horizontal(0), num_vertical(0), seed(0), source_hash(0)
+{
+}
+
+void Map_File::save(const std::string &t_filename, const Map_Instance &t_map, std::uint64_t t_seed, std::uint64_t t_source_hash)
+{
+  std::uint8_t header[header_size] = { 0 };
+  std::memcpy(header, magic, sizeof(magic));
+  put(header + 8, version, 4);
+  put(header + 12, std::uint32_t(t_map.tile_width()), 4);
+  put(header + 16, std::uint32_t(t_map.tile_height()), 4);
+  put(header + 20, std::uint32_t(t_map.num_horizontal()), 4);
+  put(header + 24, std::uint32_t(t_map.num_vertical()), 4);
+  put(header + 32, t_seed, 8);
+  put(header + 40, t_source_hash, 8);
+
+  // Written next to the destination and renamed over it, so a failed save
+  // leaves the previous file, and any map still mapped from it, intact
+  const std::string temporary_filename = t_filename + ".tmp";
+
+  {
+    std::ofstream file(temporary_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(header), header_size);
+
+    std::vector<std::uint8_t> row(t_map.num_horizontal());
+    for (int y = 0; y < t_map.num_vertical() && file; ++y)
+    {
+      const std::uint8_t *packed = t_map.dense_row(y);
+      if (!packed)
+      {
+        t_map.read_row(0, y, t_map.num_horizontal(), row.data());
+        packed = row.data();
+      }
+
+      file.write(reinterpret_cast<const char *>(packed), t_map.num_horizontal());
+    }
+
+    file.close();
+
+    if (!file)
+    {
+      std::remove(temporary_filename.c_str());
+      throw std::runtime_error("Unable to write map file: " + t_filename);
+    }
+  }
+
+#ifdef _WIN32
+  const bool replaced = MoveFileExA(temporary_filename.c_str(), t_filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  const bool replaced = std::rename(temporary_filename.c_str(), t_filename.c_str()) == 0;
+#endif
+
+  if (!replaced)
+  {
+    std::remove(temporary_filename.c_str());
+    throw std::runtime_error("Unable to write map file: " + t_filename);
+  }
+}
+
+Map_File::Header Map_File::parse_header(const std::uint8_t *t_data, size_t t_size, const std::string &t_filename)
+{
+  if (t_size < header_size || std::memcmp(t_data, magic, sizeof(magic)) != 0)
+  {
+    throw std::runtime_error("Not a map file: " + t_filename);
+  }
+
+  Header header;
+  header.version = std::uint32_t(get(t_data + 8, 4));
+  header.tile_width = int(get(t_data + 12, 4));
+  header.tile_height = int(get(t_data + 16, 4));
+  header.num_horizontal = int(get(t_data + 20, 4));
+  header.num_vertical = int(get(t_data + 24, 4));
+  header.seed = get(t_data + 32, 8);
+  header.source_hash = get(t_data + 40, 8);
+
+  if (header.version != version)
+  {
+    throw std::runtime_error("Unsupported map file version: " + t_filename);
+  }
+
+  if (header.num_horizontal < 0 || header.num_vertical < 0
+      || t_size - header_size < size_t(header.num_horizontal) * size_t(header.num_vertical))
+  {
+    throw std::runtime_error("Truncated map file: " + t_filename);
+  }
+
+  return header;
+}
+
+Map_File::Header Map_File::read_header(const std::string &t_filename)
+{
+  std::ifstream file(t_filename.c_str(), std::ios::in | std::ios::binary);
+
+  if (!file)
+  {
+    throw std::runtime_error("Unable to open map file: " + t_filename);
+  }
+
+  std::uint8_t header[header_size] = { 0 };
+  file.read(reinterpret_cast<char *>(header), header_size);
+
+  file.seekg(0, std::ios::end);
+  const size_t size = size_t(file.tellg());
+
+  return parse_header(header, size, t_filename);
+}
+
+Map_Instance Map_File::load(const std::string &t_filename)
+{
+  std::shared_ptr<Mapped_File> mapping = std::make_shared<Mapped_File>(t_filename);
+
+  const Header header = parse_header(mapping->data(), mapping->size(), t_filename);
+
+  return Map_Instance(header.tile_width, header.tile_height, header.num_horizontal, header.num_vertical,
+      mapping, mapping->data() + header_size);
+}
@@ -0,0 +1,67 @@
+#ifndef WORLDBUILDER_MAP_FILE_HPP
+#define WORLDBUILDER_MAP_FILE_HPP
+
+#include "Map.hpp"
+
+#include <cstdint>
+#include <string>
+
+/// Versioned binary file holding one rendered Map_Instance, so a world does not
+/// have to be rendered again when nothing it was generated from has changed.
+///
+///   offset  size  field
+///        0     8  magic "WBMAP\0\0\0"
+///        8     4  format version, bumped whenever the same seed and source
+///                 would render a different map. The cache of evaluated
+///                 scripts in main.cpp keys on it as well.
+///       12     4  tile width
+///       16     4  tile height
+///       20     4  number of horizontal tiles
+///       24     4  number of vertical tiles
+///       28     4  reserved, 0
+///       32     8  seed
+///       40     8  source hash, identifies what the map was generated from
+///       48    16  reserved, 0
+///       64        num_horizontal * num_vertical tiles, row major, one byte
+///                 each as produced by Map_Instance::pack()
+///
+/// Fields are stored little endian.
+class Map_File
+{
+  public:
+    static const std::uint32_t version = 2;
+
+    struct Header
+    {
+      Header();
+
+      std::uint32_t version;
+      int tile_width;
+      int tile_height;
+      int num_horizontal;
+      int num_vertical;
+      std::uint64_t seed;
+      std::uint64_t source_hash;
+    };
+
+    /// Writes t_filename + ".tmp" and renames it over t_filename, so the
+    /// previous file stays intact until the new one is complete. Throws
+    /// std::runtime_error if the file cannot be written.
+    static void save(const std::string &t_filename, const Map_Instance &t_map, std::uint64_t t_seed, std::uint64_t t_source_hash);
+
+    /// Throws std::runtime_error if the file cannot be read or is not a map
+    /// file of the current version.
+    static Header read_header(const std::string &t_filename);
+
+    /// Memory maps the file and returns a Map_Instance reading its tiles
+    /// straight from the mapping, nothing is copied. The mapping is released
+    /// with the last copy of the instance.
+    static Map_Instance load(const std::string &t_filename);
+
+  private:
+    static const size_t header_size = 64;
+
+    static Header parse_header(const std::uint8_t *t_data, size_t t_size, const std::string &t_filename);
+};
+
+#endif
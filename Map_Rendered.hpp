@@ -0,0 +1,365 @@
+#ifndef WORLDBUILDER_MAP_RENDERED_HPP
+#define WORLDBUILDER_MAP_RENDERED_HPP
+
+#include "Map.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+/// The placed shapes and feature points of one Map::render call, in a
+/// resolution independent space, plus the code that turns them into tiles.
+struct Map::Map_Rendered
+{
+  Map_Rendered(Terrain_Type t_background, double t_aspect_ratio)
+    : background(t_background), aspect_ratio(t_aspect_ratio)
+  {
+  }
+
+  struct Map_Rendered_Terrain
+  {
+    Map_Rendered_Terrain(const Shape &t_shape, Terrain_Type t_type)
+      : shape(t_shape), type(t_type)
+    {
+    }
+
+    Shape shape;
+    Terrain_Type type;
+  };
+
+  struct Map_Rendered_Feature
+  {
+    Map_Rendered_Feature(const Point &t_point, Feature_Type t_type)
+      : point(t_point), type(t_type)
+    {
+    }
+
+    Point point;
+    Feature_Type type;
+  };
+
+  std::vector<Map_Rendered_Terrain> terrains;
+  std::vector<Map_Rendered_Feature> features;
+
+  Terrain_Type background;
+  double aspect_ratio;
+
+  /// t_random is the terrain's own stream, see Map::render_terrain()
+  void add_terrain(Terrain_Type t_type, Location t_location, Random_Stream t_random)
+  {
+    Shape shape(region().get_location(t_location), t_random);
+
+    terrains.push_back(Map_Rendered_Terrain(shape, t_type));
+  }
+
+  void add_feature(Feature_Type t_type, Point t_p)
+  {
+    features.push_back(Map_Rendered_Feature(t_p, t_type));
+  }
+
+  Region region() const
+  {
+    return Region(aspect_ratio, 1.0);
+  }
+
+  std::vector<std::pair<Point, Feature_Type>> map_features(double t_width, double t_height) const
+  {
+    double region_width = region().width();
+    double region_height = region().height();
+
+    std::vector<std::pair<Point, Feature_Type>> retval;
+
+    for (const Map_Rendered_Feature &feature: features)
+    {
+      retval.push_back(std::make_pair(Point(t_width * (feature.point.x / region_width), t_height * (feature.point.y / region_height)), feature.type));
+    }
+
+    return retval;
+  }
+
+  Point sample_point(double t_width, double t_height, const Point &t_p) const
+  {
+    return Point(t_p.x / t_width * region().width(), t_p.y / t_height * region().height());
+  }
+
+  Terrain_Type terrain_at(const Point &t_scaled_point) const
+  {
+    for (auto itr = terrains.rbegin();
+        itr != terrains.rend();
+        ++itr)
+    {
+      if (itr->shape.contains(t_scaled_point))
+      {
+        return itr->type;
+      }
+    }
+
+    return background;
+  }
+
+  Region tile_region(double t_width, double t_height, const Point &t_scaled_point) const
+  {
+    return Region(t_scaled_point, region().width() / t_width, region().height() / t_height);
+  }
+
+  Feature_Type feature_at(double t_width, double t_height, const Point &t_scaled_point) const
+  {
+    Region r = tile_region(t_width, t_height, t_scaled_point);
+
+    for (const auto &feature: features)
+    {
+      if (r.contains(feature.point))
+      {
+        return feature.type;
+      }
+    }
+
+    return None;
+  }
+
+  Map_Location at(double t_width, double t_height, Point t_p) const
+  {
+    Point scaled_point = sample_point(t_width, t_height, t_p);
+
+    Map_Location loc;
+    loc.terrain = terrain_at(scaled_point);
+    loc.feature = feature_at(t_width, t_height, scaled_point);
+
+    return loc;
+  }
+
+  /// Terrain of the tiles in columns [t_first_x, t_end_x) of row t_y by
+  /// testing each tile's sample point against the terrains, last added first,
+  /// with Shape::contains_batch(). Gives the same result as terrain_at().
+  void classify_terrain_row(int t_width, int t_height, int t_y, int t_first_x, int t_end_x, std::vector<Terrain_Type> &t_row) const
+  {
+    const int num_columns = t_end_x - t_first_x;
+
+    t_row.assign(num_columns, background);
+
+    std::vector<int> unresolved(num_columns);
+    std::vector<double> xs(num_columns);
+    std::vector<double> ys(num_columns);
+    std::unique_ptr<bool[]> inside(new bool[num_columns]);
+
+    for (int i = 0; i < num_columns; ++i)
+    {
+      const Point p = sample_point(t_width, t_height, Point(t_first_x + i, t_y));
+      unresolved[i] = i;
+      xs[i] = p.x;
+      ys[i] = p.y;
+    }
+
+    for (auto itr = terrains.rbegin();
+        itr != terrains.rend() && !unresolved.empty();
+        ++itr)
+    {
+      itr->shape.contains_batch(xs.data(), ys.data(), int(unresolved.size()), inside.get());
+
+      // keep the points that are still unresolved packed at the front
+      size_t remaining = 0;
+      for (size_t i = 0; i < unresolved.size(); ++i)
+      {
+        if (inside[i])
+        {
+          t_row[unresolved[i]] = itr->type;
+        } else {
+          unresolved[remaining] = unresolved[i];
+          xs[remaining] = xs[i];
+          ys[remaining] = ys[i];
+          ++remaining;
+        }
+      }
+
+      unresolved.resize(remaining);
+    }
+  }
+
+  /// Coverage of every tile of row t_y by each terrain, Terrain_Coverage::num_terrains
+  /// fractions per tile in t_fractions. Starts from the background and
+  /// paints each terrain's Shape::cover_row() over the terrains added before
+  /// it, the way an opaque layer with fractional alpha would be.
+  void coverage_row(int t_width, int t_height, int t_y, std::vector<double> &t_fractions) const
+  {
+    const int num_terrains = Forest + 1;
+
+    t_fractions.assign(size_t(t_width) * num_terrains, 0.0);
+    for (int x = 0; x < t_width; ++x)
+    {
+      t_fractions[x * num_terrains + background] = 1;
+    }
+
+    const double top = sample_point(t_width, t_height, Point(0, t_y)).y;
+    const double bottom = sample_point(t_width, t_height, Point(0, t_y + 1)).y;
+    const double column_width = region().width() / t_width;
+
+    std::vector<double> uncovered(t_width, 1.0);
+
+    for (const auto &terrain: terrains)
+    {
+      int first = 0;
+      int last = 0;
+      terrain.shape.cover_row(top, bottom, t_width, column_width, uncovered.data(), first, last);
+
+      for (int x = first; x <= last; ++x)
+      {
+        const double covered = 1 - uncovered[x];
+        uncovered[x] = 1;
+
+        double *fractions = &t_fractions[x * num_terrains];
+        for (int i = 0; i < num_terrains; ++i)
+        {
+          fractions[i] *= 1 - covered;
+        }
+        fractions[terrain.type] += covered;
+      }
+    }
+  }
+
+  typedef std::vector<std::vector<std::pair<int, Feature_Type>>> Feature_Rows;
+
+  /// Buckets every feature into the tiles whose region contains it, one
+  /// bucket per row, sorted by column. A point on a tile edge belongs to
+  /// both neighbouring tiles, exactly as in feature_at(). Where several
+  /// features share a tile only the first one added is kept, which matches
+  /// the first-match scan in feature_at().
+  Feature_Rows bin_features(int t_width, int t_height) const
+  {
+    Feature_Rows rows(t_height);
+    bin_features(t_width, t_height, 0, t_height, rows);
+    return rows;
+  }
+
+  /// Rebuilds only rows [t_first_y, t_end_y) of t_rows, which has to hold
+  /// t_height rows. Still visits every feature, but no other row.
+  void bin_features(int t_width, int t_height, int t_first_y, int t_end_y, Feature_Rows &t_rows) const
+  {
+    for (int y = t_first_y; y < t_end_y; ++y)
+    {
+      t_rows[y].clear();
+    }
+
+    const double column_width = region().width() / t_width;
+    const double row_height = region().height() / t_height;
+
+    for (const auto &feature: features)
+    {
+      const int column = int(std::floor(feature.point.x / column_width));
+      const int row = int(std::floor(feature.point.y / row_height));
+
+      // the estimate may be off by one either way due to rounding, settle it
+      // with the same region test feature_at() uses
+      for (int y = std::max(t_first_y, row - 1); y <= std::min(t_end_y - 1, row + 1); ++y)
+      {
+        for (int x = std::max(0, column - 1); x <= std::min(t_width - 1, column + 1); ++x)
+        {
+          if (tile_region(t_width, t_height, sample_point(t_width, t_height, Point(x, y))).contains(feature.point))
+          {
+            t_rows[y].push_back(std::make_pair(x, feature.type));
+          }
+        }
+      }
+    }
+
+    for (int y = t_first_y; y < t_end_y; ++y)
+    {
+      auto &row = t_rows[y];
+
+      std::stable_sort(row.begin(), row.end(),
+          [](const std::pair<int, Feature_Type> &t_lhs, const std::pair<int, Feature_Type> &t_rhs) { return t_lhs.first < t_rhs.first; });
+
+      row.erase(std::unique(row.begin(), row.end(),
+            [](const std::pair<int, Feature_Type> &t_lhs, const std::pair<int, Feature_Type> &t_rhs) { return t_lhs.first == t_rhs.first; }),
+          row.end());
+    }
+  }
+
+  /// Terrain of the tiles in columns [t_first_x, t_end_x) of row t_y,
+  /// painted shape by shape in the order the terrains were added, so the last
+  /// matching terrain wins just as in terrain_at(). t_set(x, terrain) is
+  /// called at least once for every column in the range.
+  template<typename Set>
+    void rasterize_terrain_row(int t_width, int t_height, int t_y, int t_first_x, int t_end_x, const Set &t_set) const
+    {
+      for (int x = t_first_x; x < t_end_x; ++x)
+      {
+        t_set(x, background);
+      }
+
+      const double column_width = region().width() / t_width;
+      const double y = sample_point(t_width, t_height, Point(0, t_y)).y;
+
+      auto sample = [&](int t_x) { return sample_point(t_width, t_height, Point(t_x, t_y)); };
+
+      for (const auto &terrain: terrains)
+      {
+        terrain.shape.rasterize_row(y, t_width, column_width, sample,
+            [&](int t_first, int t_last)
+            {
+              for (int x = std::max(t_first, t_first_x); x <= std::min(t_last, t_end_x - 1); ++x)
+              {
+                t_set(x, terrain.type);
+              }
+            }
+          );
+      }
+    }
+
+  /// Rasterizes the tiles in columns [t_first_x, t_end_x) of rows
+  /// [t_first_y, t_end_y) and hands each one to t_set(x, y, tile). Every tile
+  /// only depends on this map, so any block layout gives the same tiles.
+  /// t_feature_rows has to come from bin_features() for the
+  /// Scanline_Rasterizer and is not used by the Point_Query_Rasterizer.
+  template<typename Set>
+    void rasterize(Rasterizer t_rasterizer, const Feature_Rows &t_feature_rows, int t_width, int t_height,
+        int t_first_x, int t_end_x, int t_first_y, int t_end_y, const Set &t_set) const
+    {
+      std::vector<Map_Instance::Map_Tile> row(t_end_x - t_first_x);
+      std::vector<Terrain_Type> terrain_row;
+
+      for (int y = t_first_y; y < t_end_y; ++y)
+      {
+        switch (t_rasterizer)
+        {
+          case Scanline_Rasterizer:
+            {
+              rasterize_terrain_row(t_width, t_height, y, t_first_x, t_end_x,
+                  [&](int t_x, Terrain_Type t_terrain) { row[t_x - t_first_x].terrain_type = t_terrain; });
+
+              for (auto &tile: row)
+              {
+                tile.feature_type = None;
+              }
+
+              const auto &features_on_row = t_feature_rows[y];
+              auto feature = std::lower_bound(features_on_row.begin(), features_on_row.end(), std::make_pair(t_first_x, None),
+                  [](const std::pair<int, Feature_Type> &t_lhs, const std::pair<int, Feature_Type> &t_rhs) { return t_lhs.first < t_rhs.first; });
+
+              for (; feature != features_on_row.end() && feature->first < t_end_x; ++feature)
+              {
+                row[feature->first - t_first_x].feature_type = feature->second;
+              }
+            }
+            break;
+
+          case Point_Query_Rasterizer:
+            classify_terrain_row(t_width, t_height, y, t_first_x, t_end_x, terrain_row);
+
+            for (int x = t_first_x; x < t_end_x; ++x)
+            {
+              row[x - t_first_x].terrain_type = terrain_row[x - t_first_x];
+              row[x - t_first_x].feature_type = feature_at(t_width, t_height, sample_point(t_width, t_height, Point(x, y)));
+            }
+            break;
+        }
+
+        for (int x = t_first_x; x < t_end_x; ++x)
+        {
+          t_set(x, y, row[x - t_first_x]);
+        }
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,749 @@
+#include "Pathfinder.hpp"
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+
+namespace
+{
+  /// passable borders at least this long get an entrance at either end
+  /// instead of one in the middle, so routes along them are not bent
+  const int min_double_entrance = 6;
+
+  typedef std::pair<int, int> Queue_Entry; //< priority and tile or node
+
+  /// Min-heap operations on a plain vector, so the storage outlives a search
+  void push_entry(std::vector<Queue_Entry> &t_heap, const Queue_Entry &t_entry)
+  {
+    t_heap.push_back(t_entry);
+    std::push_heap(t_heap.begin(), t_heap.end(), std::greater<Queue_Entry>());
+  }
+
+  Queue_Entry pop_entry(std::vector<Queue_Entry> &t_heap)
+  {
+    std::pop_heap(t_heap.begin(), t_heap.end(), std::greater<Queue_Entry>());
+    const Queue_Entry entry = t_heap.back();
+    t_heap.pop_back();
+    return entry;
+  }
+}
+
+Map_Position::Map_Position(int t_x, int t_y)
+  : x(t_x), y(t_y)
+{
+}
+
+bool Map_Position::operator==(const Map_Position &t_rhs) const
+{
+  return x == t_rhs.x && y == t_rhs.y;
+}
+
+Path::Path()
+  : found(false), cost(0)
+{
+}
+
+int Pathfinder::terrain_cost(Terrain_Type t_terrain)
+{
+  switch (t_terrain)
+  {
+    case Plain:
+      return 1;
+    case Forest:
+      return 2;
+    case Mountain:
+      return 4;
+    case Swamp:
+      return 6;
+    case Water:
+      return 0;
+  }
+
+  return 0;
+}
+
+std::vector<Map_Position> Pathfinder::feature_positions(const Map_Instance &t_map)
+{
+  std::vector<Map_Position> positions;
+
+  for (int y = 0; y < t_map.num_vertical(); ++y)
+  {
+    for (int x = 0; x < t_map.num_horizontal(); ++x)
+    {
+      if (t_map.at(x, y).feature_type != None)
+      {
+        positions.push_back(Map_Position(x, y));
+      }
+    }
+  }
+
+  return positions;
+}
+
+Pathfinder::Pathfinder(const Map_Instance &t_map, int t_cluster_size, size_t t_cache_capacity)
+  : m_width(t_map.num_horizontal()), m_height(t_map.num_vertical()), m_cluster_size(std::max(2, t_cluster_size)),
+    m_clusters_x((m_width + m_cluster_size - 1) / m_cluster_size), m_clusters_y((m_height + m_cluster_size - 1) / m_cluster_size),
+    m_costs(size_t(m_width) * m_height), m_clusters(size_t(m_clusters_x) * m_clusters_y),
+    m_search_x0(0), m_search_y0(0), m_search_x1(0), m_search_y1(0), m_stamp(0),
+    m_cache_capacity(std::max(size_t(1), t_cache_capacity))
+{
+  Scoped_Timer timer("Pathfinder::build");
+
+  for (int y = 0; y < m_height; ++y)
+  {
+    for (int x = 0; x < m_width; ++x)
+    {
+      m_costs[index(x, y)] = std::uint8_t(terrain_cost(t_map.at(x, y).terrain_type));
+    }
+  }
+
+  for (int cluster = 0; cluster < num_clusters(); ++cluster)
+  {
+    build_cluster(cluster);
+  }
+
+  number_entrances();
+}
+
+int Pathfinder::index(int x, int y) const
+{
+  return y * m_width + x;
+}
+
+int Pathfinder::cluster_of(int t_tile) const
+{
+  return (t_tile / m_width / m_cluster_size) * m_clusters_x + (t_tile % m_width) / m_cluster_size;
+}
+
+void Pathfinder::cluster_bounds(int t_cluster, int &t_x0, int &t_y0, int &t_x1, int &t_y1) const
+{
+  t_x0 = (t_cluster % m_clusters_x) * m_cluster_size;
+  t_y0 = (t_cluster / m_clusters_x) * m_cluster_size;
+  t_x1 = std::min(m_width, t_x0 + m_cluster_size);
+  t_y1 = std::min(m_height, t_y0 + m_cluster_size);
+}
+
+int Pathfinder::num_clusters() const
+{
+  return m_clusters_x * m_clusters_y;
+}
+
+size_t Pathfinder::num_entrances() const
+{
+  size_t entrances = 0;
+  for (const Cluster &cluster: m_clusters)
+  {
+    entrances += cluster.entrances.size();
+  }
+  return entrances;
+}
+
+size_t Pathfinder::num_cached_paths() const
+{
+  return m_cache.size();
+}
+
+int Pathfinder::local_index(int t_tile) const
+{
+  const int x = t_tile % m_width;
+  const int y = t_tile / m_width;
+
+  if (x < m_search_x0 || x >= m_search_x1 || y < m_search_y0 || y >= m_search_y1)
+  {
+    return -1;
+  }
+
+  return (y - m_search_y0) * (m_search_x1 - m_search_x0) + x - m_search_x0;
+}
+
+int Pathfinder::distance(int t_tile) const
+{
+  const int local = local_index(t_tile);
+  return local < 0 ? -1 : m_distance[local];
+}
+
+void Pathfinder::search_cluster(int t_cluster, int t_source, bool t_reverse, int t_target)
+{
+  int x0, y0, x1, y1;
+  cluster_bounds(t_cluster, x0, y0, x1, y1);
+  search_area(x0, y0, x1, y1, t_source, t_reverse, t_target);
+}
+
+void Pathfinder::search_area(int t_x0, int t_y0, int t_x1, int t_y1, int t_source, bool t_reverse, int t_target)
+{
+  m_search_x0 = t_x0;
+  m_search_y0 = t_y0;
+  m_search_x1 = t_x1;
+  m_search_y1 = t_y1;
+
+  const int width = m_search_x1 - m_search_x0;
+  const int height = m_search_y1 - m_search_y0;
+
+  m_distance.assign(size_t(width) * height, -1);
+  m_parent.assign(size_t(width) * height, -1);
+
+  m_area_open.clear();
+  m_distance[local_index(t_source)] = 0;
+  push_entry(m_area_open, Queue_Entry(0, t_source));
+
+  const int dx[] = { 1, -1, 0, 0 };
+  const int dy[] = { 0, 0, 1, -1 };
+
+  while (!m_area_open.empty())
+  {
+    const Queue_Entry entry = pop_entry(m_area_open);
+
+    const int tile = entry.second;
+    if (entry.first > distance(tile))
+    {
+      continue;
+    }
+
+    if (tile == t_target)
+    {
+      break;
+    }
+
+    const int x = tile % m_width;
+    const int y = tile / m_width;
+
+    for (int direction = 0; direction < 4; ++direction)
+    {
+      const int nx = x + dx[direction];
+      const int ny = y + dy[direction];
+
+      if (nx < m_search_x0 || nx >= m_search_x1 || ny < m_search_y0 || ny >= m_search_y1)
+      {
+        continue;
+      }
+
+      const int neighbour = index(nx, ny);
+      if (!m_costs[neighbour])
+      {
+        continue;
+      }
+
+      // forwards the step enters the neighbour, reversed it enters this tile
+      const int cost = entry.first + (t_reverse ? m_costs[tile] : m_costs[neighbour]);
+      const int local = local_index(neighbour);
+
+      if (m_distance[local] < 0 || cost < m_distance[local])
+      {
+        m_distance[local] = cost;
+        m_parent[local] = tile;
+        push_entry(m_area_open, Queue_Entry(cost, neighbour));
+      }
+    }
+  }
+}
+
+void Pathfinder::add_border(int t_cluster, int t_x, int t_y, int t_dx, int t_dy, int t_length, int t_across_x, int t_across_y)
+{
+  Cluster &cluster = m_clusters[t_cluster];
+
+  const auto add_entrance = [&](int t_i)
+  {
+    const int tile = index(t_x + t_i * t_dx, t_y + t_i * t_dy);
+    const int across = index(t_x + t_i * t_dx + t_across_x, t_y + t_i * t_dy + t_across_y);
+
+    auto existing = std::find(cluster.entrances.begin(), cluster.entrances.end(), tile);
+    if (existing == cluster.entrances.end())
+    {
+      existing = cluster.entrances.insert(existing, tile);
+    }
+
+    cluster.crossings.push_back(std::make_pair(int(existing - cluster.entrances.begin()), across));
+  };
+
+  // Both clusters walk the shared border in the same order, so they agree on
+  // where the entrances go.
+  int run_start = -1;
+
+  for (int i = 0; i <= t_length; ++i)
+  {
+    const bool passable = i < t_length
+      && m_costs[index(t_x + i * t_dx, t_y + i * t_dy)]
+      && m_costs[index(t_x + i * t_dx + t_across_x, t_y + i * t_dy + t_across_y)];
+
+    if (passable && run_start < 0)
+    {
+      run_start = i;
+    } else if (!passable && run_start >= 0) {
+      const int run_end = i - 1;
+
+      if (run_end - run_start + 1 >= min_double_entrance)
+      {
+        add_entrance(run_start);
+        add_entrance(run_end);
+      } else {
+        add_entrance((run_start + run_end) / 2);
+      }
+
+      run_start = -1;
+    }
+  }
+}
+
+void Pathfinder::build_cluster(int t_cluster)
+{
+  Cluster &cluster = m_clusters[t_cluster];
+  cluster.entrances.clear();
+  cluster.crossings.clear();
+
+  const int cluster_x = t_cluster % m_clusters_x;
+  const int cluster_y = t_cluster / m_clusters_x;
+
+  int x0, y0, x1, y1;
+  cluster_bounds(t_cluster, x0, y0, x1, y1);
+
+  if (cluster_x > 0)
+  {
+    add_border(t_cluster, x0, y0, 0, 1, y1 - y0, -1, 0);
+  }
+
+  if (cluster_x + 1 < m_clusters_x)
+  {
+    add_border(t_cluster, x1 - 1, y0, 0, 1, y1 - y0, 1, 0);
+  }
+
+  if (cluster_y > 0)
+  {
+    add_border(t_cluster, x0, y0, 1, 0, x1 - x0, 0, -1);
+  }
+
+  if (cluster_y + 1 < m_clusters_y)
+  {
+    add_border(t_cluster, x0, y1 - 1, 1, 0, x1 - x0, 0, 1);
+  }
+
+  const size_t num_entrances = cluster.entrances.size();
+  cluster.costs.assign(num_entrances * num_entrances, -1);
+
+  for (size_t i = 0; i < num_entrances; ++i)
+  {
+    search_cluster(t_cluster, cluster.entrances[i], false);
+
+    for (size_t j = 0; j < num_entrances; ++j)
+    {
+      cluster.costs[i * num_entrances + j] = distance(cluster.entrances[j]);
+    }
+  }
+}
+
+void Pathfinder::number_entrances()
+{
+  m_first_entrance.resize(m_clusters.size() + 1);
+  m_entrance_tiles.clear();
+
+  for (size_t cluster = 0; cluster < m_clusters.size(); ++cluster)
+  {
+    m_first_entrance[cluster] = int(m_entrance_tiles.size());
+    m_entrance_tiles.insert(m_entrance_tiles.end(), m_clusters[cluster].entrances.begin(), m_clusters[cluster].entrances.end());
+  }
+  m_first_entrance.back() = int(m_entrance_tiles.size());
+
+  // Both sides of a border place their entrances on the same rows or
+  // columns, so the tile across a crossing is an entrance of the neighbour.
+  for (Cluster &cluster: m_clusters)
+  {
+    cluster.crossing_targets.clear();
+
+    for (const auto &crossing: cluster.crossings)
+    {
+      const int neighbour = cluster_of(crossing.second);
+      const std::vector<int> &entrances = m_clusters[neighbour].entrances;
+      const auto target = std::find(entrances.begin(), entrances.end(), crossing.second);
+
+      cluster.crossing_targets.push_back(target == entrances.end() ? -1 : m_first_entrance[neighbour] + int(target - entrances.begin()));
+    }
+  }
+
+  // the two ends of a query follow the entrances
+  const size_t num_nodes = m_entrance_tiles.size() + 2;
+  m_node_cost.resize(num_nodes);
+  m_node_parent.resize(num_nodes);
+  m_node_stamp.assign(num_nodes, 0);
+  m_stamp = 0;
+}
+
+void Pathfinder::mark_clusters(int t_x0, int t_y0, int t_x1, int t_y1, std::vector<bool> &t_dirty) const
+{
+  const int first_x = std::max(0, t_x0 - 1) / m_cluster_size;
+  const int first_y = std::max(0, t_y0 - 1) / m_cluster_size;
+  const int last_x = std::min(m_width - 1, t_x1) / m_cluster_size;
+  const int last_y = std::min(m_height - 1, t_y1) / m_cluster_size;
+
+  for (int y = first_y; y <= last_y; ++y)
+  {
+    for (int x = first_x; x <= last_x; ++x)
+    {
+      t_dirty[y * m_clusters_x + x] = true;
+    }
+  }
+}
+
+size_t Pathfinder::rebuild(const std::vector<bool> &t_dirty)
+{
+  size_t rebuilt = 0;
+
+  for (int cluster = 0; cluster < num_clusters(); ++cluster)
+  {
+    if (t_dirty[cluster])
+    {
+      build_cluster(cluster);
+      ++rebuilt;
+    }
+  }
+
+  if (!rebuilt)
+  {
+    return 0;
+  }
+
+  number_entrances();
+
+  // a path that was not found may exist now wherever the change was
+  for (auto itr = m_cache.begin(); itr != m_cache.end();)
+  {
+    const std::vector<int> &clusters = itr->second.clusters;
+    const bool affected = !itr->second.path.found
+      || std::any_of(clusters.begin(), clusters.end(), [&](int t_cluster) { return t_dirty[t_cluster]; });
+
+    if (affected)
+    {
+      m_lru.erase(itr->second.lru);
+      itr = m_cache.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
+
+  return rebuilt;
+}
+
+size_t Pathfinder::update(const Map_Instance &t_map)
+{
+  return update(t_map, Dirty_Rect(0, 0, m_width, m_height));
+}
+
+size_t Pathfinder::update(const Map_Instance &t_map, const Dirty_Rect &t_rect)
+{
+  if (t_map.num_horizontal() != m_width || t_map.num_vertical() != m_height)
+  {
+    throw std::range_error("Map size does not match the pathfinder");
+  }
+
+  Scoped_Timer timer("Pathfinder::update");
+
+  std::vector<bool> dirty(num_clusters(), false);
+
+  for (int y = std::max(0, t_rect.y); y < std::min(m_height, t_rect.y + t_rect.height); ++y)
+  {
+    for (int x = std::max(0, t_rect.x); x < std::min(m_width, t_rect.x + t_rect.width); ++x)
+    {
+      const std::uint8_t cost = std::uint8_t(terrain_cost(t_map.at(x, y).terrain_type));
+
+      if (cost != m_costs[index(x, y)])
+      {
+        m_costs[index(x, y)] = cost;
+        mark_clusters(x, y, x + 1, y + 1, dirty);
+      }
+    }
+  }
+
+  return rebuild(dirty);
+}
+
+bool Pathfinder::refine(int t_from, int t_to, std::vector<int> &t_tiles)
+{
+  const int from_cluster = cluster_of(t_from);
+
+  if (from_cluster != cluster_of(t_to))
+  {
+    // a crossing, one step over the border
+    t_tiles.push_back(t_to);
+    return true;
+  }
+
+  search_cluster(from_cluster, t_from, false, t_to);
+
+  if (distance(t_to) < 0)
+  {
+    return false;
+  }
+
+  trace(t_from, t_to, t_tiles);
+  return true;
+}
+
+void Pathfinder::trace(int t_from, int t_to, std::vector<int> &t_tiles) const
+{
+  const size_t first = t_tiles.size();
+  for (int tile = t_to; tile != t_from; tile = m_parent[local_index(tile)])
+  {
+    t_tiles.push_back(tile);
+  }
+  std::reverse(t_tiles.begin() + first, t_tiles.end());
+}
+
+Path Pathfinder::make_path(const std::vector<int> &t_tiles) const
+{
+  Path path;
+  path.found = true;
+
+  for (size_t i = 0; i < t_tiles.size(); ++i)
+  {
+    path.tiles.push_back(Map_Position(t_tiles[i] % m_width, t_tiles[i] / m_width));
+    path.cost += i ? m_costs[t_tiles[i]] : 0;
+  }
+
+  return path;
+}
+
+Path Pathfinder::search(int t_from, int t_to)
+{
+  Scoped_Timer timer("Pathfinder::search");
+
+  const int start_cluster = cluster_of(t_from);
+  const int goal_cluster = cluster_of(t_to);
+
+  const int start_x = start_cluster % m_clusters_x;
+  const int start_y = start_cluster / m_clusters_x;
+  const int goal_x = goal_cluster % m_clusters_x;
+  const int goal_y = goal_cluster / m_clusters_x;
+
+  if (std::abs(start_x - goal_x) <= 1 && std::abs(start_y - goal_y) <= 1)
+  {
+    // the clusters of both ends and a ring of clusters around them
+    const int x0 = std::max(0, std::min(start_x, goal_x) - 1) * m_cluster_size;
+    const int y0 = std::max(0, std::min(start_y, goal_y) - 1) * m_cluster_size;
+    const int x1 = std::min(m_width, (std::max(start_x, goal_x) + 2) * m_cluster_size);
+    const int y1 = std::min(m_height, (std::max(start_y, goal_y) + 2) * m_cluster_size);
+
+    search_area(x0, y0, x1, y1, t_from, false, t_to);
+
+    if (distance(t_to) >= 0)
+    {
+      std::vector<int> tiles(1, t_from);
+      trace(t_from, t_to, tiles);
+      return make_path(tiles);
+    }
+
+    // the route may leave the area, fall back to the entrance graph
+  }
+
+  const int start_node = m_first_entrance.back();
+  const int goal_node = start_node + 1;
+
+  // the ends connect to the entrances of their own cluster
+  m_start_edges.clear();
+  search_cluster(start_cluster, t_from, false);
+  for (size_t i = 0; i < m_clusters[start_cluster].entrances.size(); ++i)
+  {
+    const int cost = distance(m_clusters[start_cluster].entrances[i]);
+    if (cost >= 0)
+    {
+      m_start_edges.push_back(std::make_pair(m_first_entrance[start_cluster] + int(i), cost));
+    }
+  }
+  const int direct = start_cluster == goal_cluster ? distance(t_to) : -1;
+
+  m_goal_edges.clear();
+  search_cluster(goal_cluster, t_to, true);
+  for (size_t i = 0; i < m_clusters[goal_cluster].entrances.size(); ++i)
+  {
+    const int cost = distance(m_clusters[goal_cluster].entrances[i]);
+    if (cost >= 0)
+    {
+      m_goal_edges.push_back(std::make_pair(m_first_entrance[goal_cluster] + int(i), cost));
+    }
+  }
+
+  const auto node_tile = [&](int t_node)
+  {
+    return t_node == start_node ? t_from : t_node == goal_node ? t_to : m_entrance_tiles[t_node];
+  };
+
+  // every step costs at least 1, so the tile distance never overestimates
+  const auto heuristic = [&](int t_node)
+  {
+    const int tile = node_tile(t_node);
+    return std::abs(tile % m_width - t_to % m_width) + std::abs(tile / m_width - t_to / m_width);
+  };
+
+  if (++m_stamp == 0)
+  {
+    std::fill(m_node_stamp.begin(), m_node_stamp.end(), 0);
+    m_stamp = 1;
+  }
+
+  m_node_open.clear();
+
+  const auto reach = [&](int t_node, int t_parent, int t_cost)
+  {
+    if (m_node_stamp[t_node] != m_stamp || t_cost < m_node_cost[t_node])
+    {
+      m_node_stamp[t_node] = m_stamp;
+      m_node_cost[t_node] = t_cost;
+      m_node_parent[t_node] = t_parent;
+      push_entry(m_node_open, Queue_Entry(t_cost + heuristic(t_node), t_node));
+    }
+  };
+
+  reach(start_node, -1, 0);
+
+  bool found = false;
+
+  while (!m_node_open.empty())
+  {
+    const Queue_Entry entry = pop_entry(m_node_open);
+
+    const int node = entry.second;
+    const int cost = m_node_cost[node];
+    if (entry.first > cost + heuristic(node))
+    {
+      continue;
+    }
+
+    if (node == goal_node)
+    {
+      found = true;
+      break;
+    }
+
+    if (node == start_node)
+    {
+      for (const auto &edge: m_start_edges)
+      {
+        reach(edge.first, node, cost + edge.second);
+      }
+
+      if (direct >= 0)
+      {
+        reach(goal_node, node, cost + direct);
+      }
+
+      continue;
+    }
+
+    const int cluster_index = cluster_of(m_entrance_tiles[node]);
+    const Cluster &cluster = m_clusters[cluster_index];
+    const int first = m_first_entrance[cluster_index];
+    const int num_entrances = int(cluster.entrances.size());
+    const int entrance = node - first;
+
+    for (int other = 0; other < num_entrances; ++other)
+    {
+      const int route = cluster.costs[entrance * num_entrances + other];
+      if (route > 0)
+      {
+        reach(first + other, node, cost + route);
+      }
+    }
+
+    if (cluster_index == goal_cluster)
+    {
+      for (const auto &edge: m_goal_edges)
+      {
+        if (edge.first == node)
+        {
+          reach(goal_node, node, cost + edge.second);
+        }
+      }
+    }
+
+    for (size_t i = 0; i < cluster.crossings.size(); ++i)
+    {
+      if (cluster.crossings[i].first == entrance && cluster.crossing_targets[i] >= 0)
+      {
+        reach(cluster.crossing_targets[i], node, cost + m_costs[cluster.crossings[i].second]);
+      }
+    }
+  }
+
+  if (!found)
+  {
+    return Path();
+  }
+
+  // an end on an entrance tile is reached from it at no cost, skip the repeat
+  std::vector<int> hops;
+  for (int node = goal_node; node >= 0; node = m_node_parent[node])
+  {
+    if (hops.empty() || hops.back() != node_tile(node))
+    {
+      hops.push_back(node_tile(node));
+    }
+  }
+  std::reverse(hops.begin(), hops.end());
+
+  std::vector<int> tiles(1, t_from);
+  for (size_t i = 1; i < hops.size(); ++i)
+  {
+    if (!refine(hops[i - 1], hops[i], tiles))
+    {
+      return Path();
+    }
+  }
+
+  return make_path(tiles);
+}
+
+Path Pathfinder::find_path(const Map_Position &t_from, const Map_Position &t_to)
+{
+  if (t_from.x < 0 || t_from.y < 0 || t_from.x >= m_width || t_from.y >= m_height
+      || t_to.x < 0 || t_to.y < 0 || t_to.x >= m_width || t_to.y >= m_height)
+  {
+    throw std::range_error("Outside of map range");
+  }
+
+  const int from = index(t_from.x, t_from.y);
+  const int to = index(t_to.x, t_to.y);
+
+  if (!m_costs[from] || !m_costs[to])
+  {
+    return Path();
+  }
+
+  if (from == to)
+  {
+    Path path;
+    path.found = true;
+    path.tiles.push_back(t_from);
+    return path;
+  }
+
+  const std::uint64_t key = (std::uint64_t(from) << 32) | std::uint64_t(to);
+
+  auto cached = m_cache.find(key);
+  if (cached != m_cache.end())
+  {
+    m_lru.splice(m_lru.begin(), m_lru, cached->second.lru);
+    return cached->second.path;
+  }
+
+  Cached_Path entry;
+  entry.path = search(from, to);
+
+  for (const Map_Position &position: entry.path.tiles)
+  {
+    entry.clusters.push_back(cluster_of(index(position.x, position.y)));
+  }
+  std::sort(entry.clusters.begin(), entry.clusters.end());
+  entry.clusters.erase(std::unique(entry.clusters.begin(), entry.clusters.end()), entry.clusters.end());
+
+  m_lru.push_front(key);
+  entry.lru = m_lru.begin();
+  m_cache.insert(std::make_pair(key, entry));
+
+  while (m_cache.size() > m_cache_capacity)
+  {
+    m_cache.erase(m_lru.back());
+    m_lru.pop_back();
+  }
+
+  return entry.path;
+}
+
@@ -0,0 +1,176 @@
+#ifndef WORLDBUILDER_PATHFINDER_HPP
+#define WORLDBUILDER_PATHFINDER_HPP
+
+#include "Map.hpp"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+struct Map_Position
+{
+  Map_Position(int t_x, int t_y);
+
+  bool operator==(const Map_Position &t_rhs) const;
+
+  int x;
+  int y;
+};
+
+struct Path
+{
+  Path();
+
+  bool found;
+  int cost; //< sum of Pathfinder::terrain_cost() of every tile entered, the first tile is free
+  std::vector<Map_Position> tiles; //< first to last tile inclusive, empty if not found
+};
+
+/// Routes between tiles of a map, moving one tile up, down, left or right at
+/// a time and paying the terrain cost of every tile entered.
+///
+/// Searches run on a hierarchical graph in the style of HPA*. The map is cut
+/// into square clusters. Wherever neighbouring clusters share a passable
+/// stretch of border, entrance tiles are placed on both sides, and the
+/// cheapest in-cluster routes between the entrances of every cluster are
+/// precomputed. A query connects its two ends to the entrances of their
+/// clusters, searches the small entrance graph with A*, then expands each
+/// hop into tiles with a search bounded by one cluster. Paths come out near
+/// optimal, typically within a few percent of the exact cost. Ends in the
+/// same or neighbouring clusters, where the detour through an entrance would
+/// weigh most, are searched exactly on the tiles around them instead.
+///
+/// Answers are kept in a least recently used cache. When tiles change, only
+/// the clusters they touch are rebuilt, and only cached paths crossing one of
+/// them are dropped. Other cached paths stay valid, though they can miss a
+/// shortcut the change opened up.
+///
+/// Holds a copy of the terrain costs, not the map. Not thread safe.
+class Pathfinder
+{
+  public:
+    static const int default_cluster_size = 16;
+
+    /// Cost of entering a tile of t_terrain, 0 if it cannot be entered
+    static int terrain_cost(Terrain_Type t_terrain);
+
+    /// Every tile of t_map holding a Town or a Cave, row by row
+    static std::vector<Map_Position> feature_positions(const Map_Instance &t_map);
+
+    explicit Pathfinder(const Map_Instance &t_map, int t_cluster_size = default_cluster_size, size_t t_cache_capacity = 4096);
+
+    /// Cheapest route found from t_from to t_to. Not found if either end
+    /// cannot be entered or no route exists. Throws std::range_error if
+    /// either end is not on the map.
+    Path find_path(const Map_Position &t_from, const Map_Position &t_to);
+
+    /// Compares t_map, which has to be the same size, against the terrain
+    /// the graph was built from and rebuilds the clusters that changed.
+    /// Returns the number of clusters rebuilt.
+    size_t update(const Map_Instance &t_map);
+
+    /// Same, but only looks at the tiles in t_rect, such as the rectangles
+    /// Map_Editor returns
+    size_t update(const Map_Instance &t_map, const Dirty_Rect &t_rect);
+
+    int num_clusters() const;
+    size_t num_entrances() const;
+    size_t num_cached_paths() const;
+
+  private:
+    struct Cluster
+    {
+      std::vector<int> entrances; //< tile indices
+      std::vector<int> costs; //< from entrance i to entrance j within the cluster at i * size + j, -1 if unreachable
+      std::vector<std::pair<int, int>> crossings; //< entrance index and the tile across the border it steps to
+      std::vector<int> crossing_targets; //< entrance id of the tile across for every crossing, see number_entrances()
+    };
+
+    struct Cached_Path
+    {
+      Path path;
+      std::vector<int> clusters; //< sorted, every cluster the path passes through
+      std::list<std::uint64_t>::iterator lru;
+    };
+
+    int index(int x, int y) const;
+    int cluster_of(int t_tile) const;
+    void cluster_bounds(int t_cluster, int &t_x0, int &t_y0, int &t_x1, int &t_y1) const;
+
+    /// Marks the clusters holding tiles [t_x0, t_x1) x [t_y0, t_y1) grown by
+    /// one tile, whose borders may depend on them
+    void mark_clusters(int t_x0, int t_y0, int t_x1, int t_y1, std::vector<bool> &t_dirty) const;
+    size_t rebuild(const std::vector<bool> &t_dirty);
+
+    /// Finds the entrances on every border of t_cluster and the routes
+    /// between them
+    void build_cluster(int t_cluster);
+
+    /// Gives every entrance of every cluster an id, in cluster order, for
+    /// the flat per entrance arrays of search()
+    void number_entrances();
+    void add_border(int t_cluster, int t_x, int t_y, int t_dx, int t_dy, int t_length, int t_across_x, int t_across_y);
+
+    /// Dijkstra from t_source bounded by t_cluster. Afterwards distance()
+    /// gives the cost from t_source to any tile of the cluster, or reversed
+    /// the cost from the tile to t_source. Stops early once t_target is
+    /// settled.
+    void search_cluster(int t_cluster, int t_source, bool t_reverse, int t_target = -1);
+
+    /// Same, bounded by tiles [t_x0, t_x1) x [t_y0, t_y1) instead
+    void search_area(int t_x0, int t_y0, int t_x1, int t_y1, int t_source, bool t_reverse, int t_target);
+
+    /// Result of the last search_area(), -1 if t_tile was not reached
+    int distance(int t_tile) const;
+    int local_index(int t_tile) const;
+
+    /// Appends the tiles after t_from up to and including t_to, which have to
+    /// be in the same cluster or neighbours across a border
+    bool refine(int t_from, int t_to, std::vector<int> &t_tiles);
+
+    /// Appends the tiles after t_from up to and including t_to along the
+    /// parents of the last forward search from t_from
+    void trace(int t_from, int t_to, std::vector<int> &t_tiles) const;
+
+    Path search(int t_from, int t_to);
+    Path make_path(const std::vector<int> &t_tiles) const;
+
+    int m_width;
+    int m_height;
+    int m_cluster_size;
+    int m_clusters_x;
+    int m_clusters_y;
+
+    std::vector<std::uint8_t> m_costs; //< terrain_cost() of every tile
+    std::vector<Cluster> m_clusters;
+
+    // last search_area(), indexed by position within the searched area
+    int m_search_x0;
+    int m_search_y0;
+    int m_search_x1;
+    int m_search_y1;
+    std::vector<int> m_distance;
+    std::vector<int> m_parent;
+    std::vector<std::pair<int, int>> m_area_open; //< heap of search_area(), kept for its storage
+
+    // Entrance graph of search(). Nodes are entrance ids, followed by the two
+    // ends of the query. A node's cost and parent are only valid if its stamp
+    // is the current one, so nothing has to be cleared between queries.
+    std::vector<int> m_first_entrance; //< id of the first entrance of every cluster, and the total at the end
+    std::vector<int> m_entrance_tiles; //< by entrance id
+    std::vector<int> m_node_cost;
+    std::vector<int> m_node_parent;
+    std::vector<std::uint32_t> m_node_stamp;
+    std::uint32_t m_stamp;
+    std::vector<std::pair<int, int>> m_node_open; //< heap of search(), kept for its storage
+    std::vector<std::pair<int, int>> m_start_edges; //< node and cost
+    std::vector<std::pair<int, int>> m_goal_edges;
+
+    size_t m_cache_capacity;
+    std::list<std::uint64_t> m_lru; //< most recently used first
+    std::map<std::uint64_t, Cached_Path> m_cache;
+};
+
+#endif
+
@@ -4,13 +4,28 @@
 
 struct Point
 {
-  Point(double t_x, double t_y);
+  constexpr Point(double t_x, double t_y)
+    : x(t_x), y(t_y)
+  {
+  }
 
   double distance(const Point &t_p1) const;
 
-  bool operator>=(const Point &t_rhs) const;
-
-  bool operator<=(const Point &t_rhs) const;
+  /// Cheaper than distance() when only comparing, but not rounded the same way
+  constexpr double distance_squared(const Point &t_p1) const
+  {
+    return (x - t_p1.x) * (x - t_p1.x) + (y - t_p1.y) * (y - t_p1.y);
+  }
+
+  constexpr bool operator>=(const Point &t_rhs) const
+  {
+    return x >= t_rhs.x && y >= t_rhs.y;
+  }
+
+  constexpr bool operator<=(const Point &t_rhs) const
+  {
+    return x <= t_rhs.x && y <= t_rhs.y;
+  }
 
 
 
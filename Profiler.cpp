@@ -0,0 +1,503 @@
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+  struct Trace_Event
+  {
+    const char *name;
+    std::uint64_t start_ns; //< since the profiler epoch
+    std::uint64_t duration_ns;
+  };
+
+  std::atomic_bool profiler_enabled(true);
+
+  Profiler::Clock::time_point epoch()
+  {
+    static const Profiler::Clock::time_point start = Profiler::Clock::now();
+    return start;
+  }
+
+  std::uint64_t nanoseconds(Profiler::Clock::duration t_duration)
+  {
+    return std::uint64_t(std::max<long long>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(t_duration).count()));
+  }
+
+  /// JSON string literal, names are ours but thread names may come from anywhere
+  std::string quoted(const std::string &t_string)
+  {
+    std::string result = "\"";
+    for (char c: t_string)
+    {
+      if (c == '"' || c == '\\')
+      {
+        result += '\\';
+        result += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        result += ' ';
+      } else {
+        result += c;
+      }
+    }
+    return result + "\"";
+  }
+
+  typedef std::vector<std::pair<const char *, Latency_Histogram>> Histograms; //< few distinct names, searched linearly
+  typedef std::vector<std::pair<const char *, std::uint64_t>> Counters; //< likewise
+
+  template<typename Entries, typename Value>
+    Value &entry(Entries &t_entries, const char *t_name, const Value &t_initial)
+    {
+      auto existing = std::find_if(t_entries.begin(), t_entries.end(),
+          [t_name](const typename Entries::value_type &t_entry) { return t_entry.first == t_name; });
+
+      if (existing == t_entries.end())
+      {
+        t_entries.push_back(std::make_pair(t_name, t_initial));
+        existing = t_entries.end() - 1;
+      }
+
+      return existing->second;
+    }
+
+  /// Histograms and counters of the threads whose buffers were dropped,
+  /// guarded by the registry mutex
+  struct Retired_Totals
+  {
+    Histograms histograms;
+    Counters counters;
+  };
+
+  Retired_Totals &retired_totals()
+  {
+    static Retired_Totals totals;
+    return totals;
+  }
+}
+
+struct Profiler::Thread_Buffer
+{
+  Thread_Buffer(int t_id)
+    : id(t_id), ring(ring_capacity), written(0), exited(false)
+  {
+    std::stringstream ss;
+    ss << "thread " << t_id;
+    name = ss.str();
+  }
+
+  const int id;
+
+  std::mutex mutex; //< held by the owning thread while recording and by exports
+  std::string name;
+  std::vector<Trace_Event> ring;
+  size_t written; //< events ever recorded, the newest is at (written - 1) % ring_capacity
+  Histograms histograms;
+  Counters counters;
+  bool exited; //< the owning thread has finished, guarded by the registry mutex
+};
+
+Latency_Histogram::Latency_Histogram()
+  : count(0), total_ns(0), max_ns(0)
+{
+  std::fill(buckets, buckets + num_buckets, 0);
+}
+
+int Latency_Histogram::bucket(std::uint64_t t_ns)
+{
+  if (t_ns < 4)
+  {
+    return int(t_ns);
+  }
+
+  int e = 63;
+  while (!(t_ns >> e))
+  {
+    --e;
+  }
+
+  return 4 * (e - 1) + int((t_ns >> (e - 2)) & 3);
+}
+
+std::uint64_t Latency_Histogram::bucket_limit(int t_bucket)
+{
+  if (t_bucket < 4)
+  {
+    return std::uint64_t(t_bucket);
+  }
+
+  const int e = t_bucket / 4 + 1;
+  return ((std::uint64_t(4 + t_bucket % 4 + 1)) << (e - 2)) - 1;
+}
+
+void Latency_Histogram::add(std::uint64_t t_ns)
+{
+  ++buckets[bucket(t_ns)];
+  ++count;
+  total_ns += t_ns;
+  max_ns = std::max(max_ns, t_ns);
+}
+
+void Latency_Histogram::merge(const Latency_Histogram &t_other)
+{
+  for (int i = 0; i < num_buckets; ++i)
+  {
+    buckets[i] += t_other.buckets[i];
+  }
+  count += t_other.count;
+  total_ns += t_other.total_ns;
+  max_ns = std::max(max_ns, t_other.max_ns);
+}
+
+double Latency_Histogram::percentile_ms(double t_fraction) const
+{
+  const std::uint64_t rank = std::uint64_t(std::ceil(t_fraction * count));
+
+  std::uint64_t seen = 0;
+  for (int i = 0; i < num_buckets; ++i)
+  {
+    seen += buckets[i];
+    if (seen >= std::max<std::uint64_t>(rank, 1))
+    {
+      return std::min(bucket_limit(i), max_ns) / 1e6;
+    }
+  }
+
+  return max_ns / 1e6;
+}
+
+const int Latency_Histogram::num_buckets;
+
+const size_t Profiler::ring_capacity;
+const size_t Profiler::max_exited_buffers;
+
+Phase_Stats::Phase_Stats()
+  : count(0), total_ms(0), latency_p50_ms(0), latency_p90_ms(0), latency_p99_ms(0), latency_max_ms(0)
+{
+}
+
+void Profiler::set_enabled(bool t_enabled)
+{
+  profiler_enabled = t_enabled;
+}
+
+bool Profiler::enabled()
+{
+  return profiler_enabled.load(std::memory_order_relaxed);
+}
+
+std::mutex &Profiler::registry_mutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::vector<std::shared_ptr<Profiler::Thread_Buffer>> &Profiler::registry()
+{
+  static std::vector<std::shared_ptr<Thread_Buffer>> buffers;
+  return buffers;
+}
+
+Profiler::Thread_Buffer &Profiler::thread_buffer()
+{
+  // marks the buffer as exited when the thread finishes
+  struct Owner
+  {
+    ~Owner()
+    {
+      if (buffer)
+      {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        buffer->exited = true;
+        drop_exited_buffers(max_exited_buffers);
+      }
+    }
+
+    std::shared_ptr<Thread_Buffer> buffer;
+  };
+
+  static thread_local Owner owner;
+  static std::atomic<int> next_id(0);
+
+  if (!owner.buffer)
+  {
+    epoch();
+
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    owner.buffer = std::make_shared<Thread_Buffer>(next_id++);
+    registry().push_back(owner.buffer);
+  }
+
+  return *owner.buffer;
+}
+
+void Profiler::drop_exited_buffers(size_t t_keep)
+{
+  std::vector<std::shared_ptr<Thread_Buffer>> &buffers = registry();
+
+  size_t exited = size_t(std::count_if(buffers.begin(), buffers.end(),
+      [](const std::shared_ptr<Thread_Buffer> &t_buffer) { return t_buffer->exited; }));
+
+  Retired_Totals &totals = retired_totals();
+
+  // oldest first, the rings of the most recently finished threads are kept
+  for (auto buffer = buffers.begin(); buffer != buffers.end() && exited > t_keep;)
+  {
+    if (!(*buffer)->exited)
+    {
+      ++buffer;
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock((*buffer)->mutex);
+
+      for (const auto &histogram: (*buffer)->histograms)
+      {
+        entry(totals.histograms, histogram.first, Latency_Histogram()).merge(histogram.second);
+      }
+
+      for (const auto &counter: (*buffer)->counters)
+      {
+        entry(totals.counters, counter.first, std::uint64_t(0)) += counter.second;
+      }
+    }
+
+    // may be the last reference, so not while its mutex is held
+    buffer = buffers.erase(buffer);
+    --exited;
+  }
+}
+
+void Profiler::record(const char *t_name, Clock::time_point t_start, Clock::time_point t_end)
+{
+  Thread_Buffer &buffer = thread_buffer();
+
+  Trace_Event event;
+  event.name = t_name;
+  event.start_ns = nanoseconds(t_start - epoch());
+  event.duration_ns = nanoseconds(t_end - t_start);
+
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+
+  buffer.ring[buffer.written % ring_capacity] = event;
+  ++buffer.written;
+
+  entry(buffer.histograms, t_name, Latency_Histogram()).add(event.duration_ns);
+}
+
+void Profiler::count(const char *t_name, std::uint64_t t_amount)
+{
+  if (!enabled())
+  {
+    return;
+  }
+
+  Thread_Buffer &buffer = thread_buffer();
+
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+
+  entry(buffer.counters, t_name, std::uint64_t(0)) += t_amount;
+}
+
+void Profiler::set_thread_name(const std::string &t_name)
+{
+  Thread_Buffer &buffer = thread_buffer();
+
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  buffer.name = t_name;
+}
+
+std::vector<Phase_Stats> Profiler::phase_stats()
+{
+  // merged by name, the same literal may have different addresses in
+  // different translation units
+  std::vector<std::pair<std::string, Latency_Histogram>> merged;
+
+  const auto merge = [&](const Histograms &t_histograms)
+  {
+    for (const auto &histogram: t_histograms)
+    {
+      auto existing = std::find_if(merged.begin(), merged.end(),
+          [&](const std::pair<std::string, Latency_Histogram> &t_merged) { return t_merged.first == histogram.first; });
+
+      if (existing == merged.end())
+      {
+        merged.push_back(std::make_pair(std::string(histogram.first), histogram.second));
+      } else {
+        existing->second.merge(histogram.second);
+      }
+    }
+  };
+
+  {
+    std::lock_guard<std::mutex> registry_lock(registry_mutex());
+
+    merge(retired_totals().histograms);
+
+    for (const auto &buffer: registry())
+    {
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      merge(buffer->histograms);
+    }
+  }
+
+  std::vector<Phase_Stats> stats;
+
+  for (const auto &entry: merged)
+  {
+    Phase_Stats phase;
+    phase.name = entry.first;
+    phase.count = long(entry.second.count);
+    phase.total_ms = entry.second.total_ns / 1e6;
+    phase.latency_p50_ms = entry.second.percentile_ms(0.5);
+    phase.latency_p90_ms = entry.second.percentile_ms(0.9);
+    phase.latency_p99_ms = entry.second.percentile_ms(0.99);
+    phase.latency_max_ms = entry.second.max_ns / 1e6;
+    stats.push_back(phase);
+  }
+
+  std::sort(stats.begin(), stats.end(),
+      [](const Phase_Stats &t_lhs, const Phase_Stats &t_rhs) { return t_lhs.name < t_rhs.name; });
+
+  return stats;
+}
+
+std::vector<std::pair<std::string, std::uint64_t>> Profiler::counters()
+{
+  std::vector<std::pair<std::string, std::uint64_t>> merged;
+
+  const auto merge = [&](const Counters &t_counters)
+  {
+    for (const auto &counter: t_counters)
+    {
+      auto existing = std::find_if(merged.begin(), merged.end(),
+          [&](const std::pair<std::string, std::uint64_t> &t_merged) { return t_merged.first == counter.first; });
+
+      if (existing == merged.end())
+      {
+        merged.push_back(std::make_pair(std::string(counter.first), counter.second));
+      } else {
+        existing->second += counter.second;
+      }
+    }
+  };
+
+  {
+    std::lock_guard<std::mutex> registry_lock(registry_mutex());
+
+    merge(retired_totals().counters);
+
+    for (const auto &buffer: registry())
+    {
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      merge(buffer->counters);
+    }
+  }
+
+  std::sort(merged.begin(), merged.end());
+
+  return merged;
+}
+
+void Profiler::write_histograms(std::ostream &t_out)
+{
+  t_out << std::left << std::setw(32) << "phase" << std::right
+    << std::setw(10) << "count" << std::setw(12) << "mean ms" << std::setw(12) << "p50 ms"
+    << std::setw(12) << "p90 ms" << std::setw(12) << "p99 ms" << std::setw(12) << "max ms" << '\n';
+
+  for (const Phase_Stats &phase: phase_stats())
+  {
+    t_out << std::left << std::setw(32) << phase.name << std::right
+      << std::setw(10) << phase.count << std::fixed << std::setprecision(3)
+      << std::setw(12) << (phase.count ? phase.total_ms / phase.count : 0.0)
+      << std::setw(12) << phase.latency_p50_ms << std::setw(12) << phase.latency_p90_ms
+      << std::setw(12) << phase.latency_p99_ms << std::setw(12) << phase.latency_max_ms << '\n';
+  }
+
+  const std::vector<std::pair<std::string, std::uint64_t>> totals = counters();
+
+  if (!totals.empty())
+  {
+    t_out << '\n' << std::left << std::setw(32) << "counter" << std::right << std::setw(10) << "total" << '\n';
+
+    for (const auto &counter: totals)
+    {
+      t_out << std::left << std::setw(32) << counter.first << std::right << std::setw(10) << counter.second << '\n';
+    }
+  }
+
+  t_out.flush();
+}
+
+void Profiler::write_chrome_trace(const std::string &t_filename)
+{
+  std::ofstream out(t_filename.c_str());
+
+  if (!out)
+  {
+    throw std::runtime_error("Unable to write trace file: " + t_filename);
+  }
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+  bool first = true;
+  const auto separator = [&]() -> std::ostream & { out << (first ? "\n" : ",\n"); first = false; return out; };
+
+  std::lock_guard<std::mutex> registry_lock(registry_mutex());
+
+  for (const auto &buffer: registry())
+  {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+
+    separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id
+      << ",\"args\":{\"name\":" << quoted(buffer->name) << "}}";
+
+    const size_t held = std::min(buffer->written, ring_capacity);
+
+    for (size_t i = buffer->written - held; i < buffer->written; ++i)
+    {
+      const Trace_Event &event = buffer->ring[i % ring_capacity];
+
+      // microseconds with nanosecond digits
+      separator() << "{\"name\":" << quoted(event.name) << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->id
+        << ",\"ts\":" << event.start_ns / 1000 << '.' << std::setw(3) << std::setfill('0') << event.start_ns % 1000
+        << ",\"dur\":" << event.duration_ns / 1000 << '.' << std::setw(3) << event.duration_ns % 1000 << std::setfill(' ') << "}";
+    }
+  }
+
+  out << "\n]}\n";
+
+  if (!out)
+  {
+    throw std::runtime_error("Unable to write trace file: " + t_filename);
+  }
+
+  // finished threads cannot record anything new, their rings are written
+  drop_exited_buffers(0);
+}
+
+Scoped_Timer::Scoped_Timer(const char *t_name)
+  : m_name(t_name), m_enabled(Profiler::enabled())
+{
+  if (m_enabled)
+  {
+    m_start = Profiler::Clock::now();
+  }
+}
+
+Scoped_Timer::~Scoped_Timer()
+{
+  if (m_enabled)
+  {
+    Profiler::record(m_name, m_start, Profiler::Clock::now());
+  }
+}
+
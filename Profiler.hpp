@@ -0,0 +1,140 @@
+#ifndef WORLDBUILDER_PROFILER_HPP
+#define WORLDBUILDER_PROFILER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Latency summary of one phase over every thread, since start up
+struct Phase_Stats
+{
+  Phase_Stats();
+
+  std::string name;
+  long count;
+  double total_ms;
+  double latency_p50_ms; //< percentiles are bucketed, within 25% of the exact value
+  double latency_p90_ms;
+  double latency_p99_ms;
+  double latency_max_ms;
+};
+
+/// Durations in nanoseconds, four buckets per power of two, so percentiles
+/// are within 25% of the exact value. Values below 4 get a bucket each, a
+/// value v >= 4 with highest bit e lands in bucket 4 * (e - 1) + the two bits
+/// below e.
+struct Latency_Histogram
+{
+  static const int num_buckets = 4 * 63;
+
+  Latency_Histogram();
+
+  void add(std::uint64_t t_ns);
+  void merge(const Latency_Histogram &t_other);
+
+  /// Upper end of the bucket holding the value at t_fraction of the count,
+  /// 0 if empty
+  double percentile_ms(double t_fraction) const;
+
+  static int bucket(std::uint64_t t_ns);
+  /// Largest value falling into t_bucket
+  static std::uint64_t bucket_limit(int t_bucket);
+
+  std::uint64_t buckets[num_buckets];
+  std::uint64_t count;
+  std::uint64_t total_ns;
+  std::uint64_t max_ns;
+};
+
+/// Process wide record of timed phases, fed by Scoped_Timer.
+///
+/// Every thread writes to a buffer of its own: a ring holding its most recent
+/// phases for the trace and a latency histogram per phase name covering the
+/// whole run, along with counters of events such as asset loads. A thread only ever contends with an export in progress, so
+/// recording a phase costs two clock reads and an uncontended lock.
+///
+/// Buffers outlive their threads, so phases of finished threads are still
+/// exported. The ring of a finished thread is dropped once a trace has been
+/// written with it, or once more than max_exited_buffers threads have
+/// finished since, oldest first. Its histograms and counters are kept.
+///
+/// Recording is on by default and can be switched off at run time.
+class Profiler
+{
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /// most recent phases kept per thread for the trace
+    static const size_t ring_capacity = 16384;
+
+    /// finished threads whose rings are kept until the next trace is written
+    static const size_t max_exited_buffers = 16;
+
+    static void set_enabled(bool t_enabled);
+    static bool enabled();
+
+    /// Records a phase of the calling thread. t_name has to stay valid for
+    /// the life of the program, such as a string literal.
+    static void record(const char *t_name, Clock::time_point t_start, Clock::time_point t_end);
+
+    /// Adds t_amount to counter t_name of the calling thread, t_name as for
+    /// record()
+    static void count(const char *t_name, std::uint64_t t_amount);
+
+    /// Name the calling thread is shown with in the trace
+    static void set_thread_name(const std::string &t_name);
+
+    /// Per phase latencies of all threads, sorted by name
+    static std::vector<Phase_Stats> phase_stats();
+
+    /// Counter totals of all threads, sorted by name
+    static std::vector<std::pair<std::string, std::uint64_t>> counters();
+
+    /// Writes phase_stats() and counters() as tables
+    static void write_histograms(std::ostream &t_out);
+
+    /// Writes the phases still held in the rings as Chrome trace event JSON,
+    /// viewable in chrome://tracing or Perfetto. Throws std::runtime_error if
+    /// the file cannot be written.
+    static void write_chrome_trace(const std::string &t_filename);
+
+  private:
+    struct Thread_Buffer;
+
+    static Thread_Buffer &thread_buffer();
+
+    /// Folds the histograms and counters of the oldest finished threads into
+    /// the retired totals and drops their buffers, until at most t_keep
+    /// remain. The registry mutex has to be held.
+    static void drop_exited_buffers(size_t t_keep);
+
+    static std::mutex &registry_mutex();
+    /// the buffers of running threads and of recently finished ones, in
+    /// creation order
+    static std::vector<std::shared_ptr<Thread_Buffer>> &registry();
+};
+
+/// Records the time from construction to destruction as phase t_name, see
+/// Profiler::record()
+class Scoped_Timer
+{
+  public:
+    explicit Scoped_Timer(const char *t_name);
+    ~Scoped_Timer();
+
+    Scoped_Timer(const Scoped_Timer &) = delete;
+    Scoped_Timer &operator=(const Scoped_Timer &) = delete;
+
+  private:
+    const char *m_name;
+    bool m_enabled;
+    Profiler::Clock::time_point m_start;
+};
+
+#endif
+
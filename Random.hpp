@@ -0,0 +1,80 @@
+#ifndef WORLDBUILDER_RANDOM_HPP
+#define WORLDBUILDER_RANDOM_HPP
+
+#include <cstdint>
+
+/// SplitMix64 finalizer, a bijection that spreads every input bit over the
+/// whole output
+inline std::uint64_t mix64(std::uint64_t t_value)
+{
+  t_value = (t_value ^ (t_value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  t_value = (t_value ^ (t_value >> 27)) * 0x94D049BB133111EBULL;
+  return t_value ^ (t_value >> 31);
+}
+
+/// What a stream is split off for, so that streams of different parts of a
+/// map never coincide even when their indices do
+enum Random_Domain
+{
+  Map_Random,            //< one map of a world, by map index
+  Terrain_Random,        //< the shape of one terrain, by terrain index
+  Feature_Random,        //< the point of one feature, by feature index
+  Feature_Layout_Random  //< how the features of one location share it, by Location
+};
+
+/// Counter based random number generator. The n-th number of a stream is a
+/// hash of the stream's key and n, so it does not depend on what was drawn
+/// from any other stream. Every part of a map draws from its own stream,
+/// split off by (domain, index), which makes the parts independent of the
+/// order they are generated in and lets them be generated in parallel with
+/// reproducible results.
+///
+/// Satisfies the uniform random bit generator requirements, so it works with
+/// the standard distributions.
+class Random_Stream
+{
+  public:
+    typedef std::uint64_t result_type;
+
+    explicit Random_Stream(std::uint64_t t_seed)
+      : m_key(mix64(t_seed + golden_gamma)), m_counter(0)
+    {
+    }
+
+    /// Independent stream for part t_index of t_domain. Does not draw from
+    /// or advance this stream.
+    Random_Stream split(Random_Domain t_domain, std::uint64_t t_index) const
+    {
+      return Random_Stream(mix64(mix64(m_key ^ (std::uint64_t(t_domain) + 1) * golden_gamma) + t_index), keyed());
+    }
+
+    result_type operator()()
+    {
+      return mix64(m_key + ++m_counter * golden_gamma);
+    }
+
+    static constexpr result_type min()
+    {
+      return 0;
+    }
+
+    static constexpr result_type max()
+    {
+      return ~result_type(0);
+    }
+
+  private:
+    static const std::uint64_t golden_gamma = 0x9E3779B97F4A7C15ULL;
+
+    struct keyed {};
+
+    Random_Stream(std::uint64_t t_key, keyed)
+      : m_key(t_key), m_counter(0)
+    {
+    }
+
+    std::uint64_t m_key;
+    std::uint64_t m_counter;
+};
+
+#endif
@@ -2,8 +2,10 @@
 #define WORLDBUILDER_REGION
 
 #include "Point.hpp"
+#include "Random.hpp"
 
-#include <vector>
+#include <cstddef>
+#include <iterator>
 #include <random>
 
 enum Location
@@ -20,29 +22,191 @@ enum Location
 };
 
 
+class Region_Grid;
+
+/// Axis aligned rectangle. The corners are sorted on construction, so none of
+/// the queries below has to work out which one is which.
 class Region
 {
   public:
-    Region(double t_width, double t_height);
-    Region(const Point &t_p1, const Point &t_p2);
-    Region(const Point &t_p1, double t_width, double t_height);
+    constexpr Region(double t_width, double t_height)
+      : m_top_left(lesser(0, t_width), lesser(0, t_height)),
+        m_bottom_right(greater(0, t_width), greater(0, t_height))
+    {
+    }
+
+    constexpr Region(const Point &t_p1, const Point &t_p2)
+      : m_top_left(lesser(t_p1.x, t_p2.x), lesser(t_p1.y, t_p2.y)),
+        m_bottom_right(greater(t_p1.x, t_p2.x), greater(t_p1.y, t_p2.y))
+    {
+    }
+
+    constexpr Region(const Point &t_p1, double t_width, double t_height)
+      : Region(t_p1, Point(t_p1.x + t_width, t_p1.y + t_height))
+    {
+    }
+
+    /// The cell of a 3x3 subdivision the location names
+    constexpr Region get_location(Location t_location) const
+    {
+      return cell(location_column(t_location), location_row(t_location), 3, 3);
+    }
+
+    /// Cell (t_column, t_row) of subdivide(t_columns, t_rows), computed
+    /// directly
+    constexpr Region cell(int t_column, int t_row, int t_columns, int t_rows) const
+    {
+      return Region(
+          Point(width() * t_column / t_columns + m_top_left.x, height() * t_row / t_rows + m_top_left.y),
+          Point(width() * (t_column + 1) / t_columns + m_top_left.x, height() * (t_row + 1) / t_rows + m_top_left.y));
+    }
+
+    /// t_horizontal by t_vertical equal cells, row by row from the top left.
+    /// The cells are computed as they are read, nothing is allocated.
+    Region_Grid subdivide(int t_horizontal, int t_vertical) const;
+
+    constexpr double width() const
+    {
+      return m_bottom_right.x - m_top_left.x;
+    }
+
+    constexpr double height() const
+    {
+      return m_bottom_right.y - m_top_left.y;
+    }
+
+    constexpr Point top_left() const
+    {
+      return m_top_left;
+    }
+
+    constexpr Point bottom_right() const
+    {
+      return m_bottom_right;
+    }
+
+    constexpr bool contains(const Point &t_p) const
+    {
+      return t_p >= m_top_left && t_p <= m_bottom_right;
+    }
+
+    Point choose_point(Random_Stream &t_random) const;
+
+  private:
+    static constexpr double lesser(double t_lhs, double t_rhs)
+    {
+      return t_rhs < t_lhs ? t_rhs : t_lhs;
+    }
+
+    static constexpr double greater(double t_lhs, double t_rhs)
+    {
+      return t_lhs < t_rhs ? t_rhs : t_lhs;
+    }
+
+    // Location counts east to west within each row, north to south
+    static constexpr int location_column(Location t_location)
+    {
+      return 2 - int(t_location) % 3;
+    }
+
+    static constexpr int location_row(Location t_location)
+    {
+      return int(t_location) / 3;
+    }
+
+    Point m_top_left;
+    Point m_bottom_right;
+};
+
+/// The cells of Region::subdivide(). Holds only the region and the cell
+/// counts, cells are produced by operator[] and the iterators on demand.
+class Region_Grid
+{
+  public:
+    /// Dereferencing makes the cell on the fly and returns it by value, so
+    /// this is only an input iterator
+    class const_iterator
+    {
+      public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Region value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef Region reference;
+
+        constexpr const_iterator(const Region_Grid &t_grid, size_t t_index)
+          : m_grid(&t_grid), m_index(t_index)
+        {
+        }
+
+        constexpr Region operator*() const
+        {
+          return (*m_grid)[m_index];
+        }
 
-    Region get_location(Location t_location) const;
+        const_iterator &operator++()
+        {
+          ++m_index;
+          return *this;
+        }
 
-    std::vector<Region> subdivide(int t_horizontal, int t_vertical) const;
+        const_iterator operator++(int)
+        {
+          const_iterator previous(*this);
+          ++m_index;
+          return previous;
+        }
 
-    double width() const;
-    double height() const;
-    Point top_left() const;
-    Point bottom_right() const;
+        constexpr bool operator==(const const_iterator &t_rhs) const
+        {
+          return m_index == t_rhs.m_index;
+        }
 
-    bool contains(const Point &t_p) const;
-    Point choose_point(std::mt19937 &t_engine) const;
+        constexpr bool operator!=(const const_iterator &t_rhs) const
+        {
+          return m_index != t_rhs.m_index;
+        }
+
+      private:
+        const Region_Grid *m_grid;
+        size_t m_index;
+    };
+
+    constexpr Region_Grid(const Region &t_region, int t_horizontal, int t_vertical)
+      : m_region(t_region), m_horizontal(t_horizontal), m_vertical(t_vertical)
+    {
+    }
+
+    constexpr size_t size() const
+    {
+      return size_t(m_horizontal) * size_t(m_vertical);
+    }
+
+    constexpr Region operator[](size_t t_index) const
+    {
+      return m_region.cell(int(t_index % m_horizontal), int(t_index / m_horizontal), m_horizontal, m_vertical);
+    }
+
+    constexpr const_iterator begin() const
+    {
+      return const_iterator(*this, 0);
+    }
+
+    constexpr const_iterator end() const
+    {
+      return const_iterator(*this, size());
+    }
 
   private:
-    Point m_p1;
-    Point m_p2;
+    Region m_region;
+    int m_horizontal;
+    int m_vertical;
 };
 
+inline Region_Grid Region::subdivide(int t_horizontal, int t_vertical) const
+{
+  return Region_Grid(*this, t_horizontal, t_vertical);
+}
+
 #endif
 
@@ -1,10 +1,15 @@
 #ifndef WORLDBUILDER_SDL_HPP
 #define WORLDBUILDER_SDL_HPP
 
+#include <algorithm>
+#include <chrono>
 #include <stdexcept>
 #include <string>
+#include <memory>
+#include <vector>
 
 
+#include "Profiler.hpp"
 #include "World.hpp"
 
 #include <SDL/SDL.h>
@@ -67,6 +72,23 @@ class Surface
       SDL_BlitSurface(m_surface, NULL, t_surface.m_surface, &dest);
     }
 
+    void render(Surface &t_surface, int t_x, int t_y, const SDL_Rect &t_source) const
+    {
+      SDL_Rect source = t_source;
+      SDL_Rect dest;
+      dest.x = t_x;
+      dest.y = t_y;
+      dest.w = source.w;
+      dest.h = source.h;
+
+      SDL_BlitSurface(m_surface, &source, t_surface.m_surface, &dest);
+    }
+
+    SDL_Surface *get() const
+    {
+      return m_surface;
+    }
+
     double width() const
     {
       return m_surface->w;
@@ -78,14 +100,17 @@ class Surface
     }
 
   private:
+    Surface(const Surface &);
+    Surface &operator=(const Surface &);
+
     SDL_Surface *m_surface;
 };
 
 class Screen
 {
   public:
-    Screen()
-      : m_initializer(), m_surface(SDL_SetVideoMode(640, 480, 32, SDL_HWSURFACE | SDL_HWACCEL))
+    Screen(int t_width, int t_height)
+      : m_initializer(), m_surface(SDL_SetVideoMode(t_width, t_height, 32, SDL_HWSURFACE | SDL_HWACCEL))
     {
 
     }
@@ -116,129 +141,495 @@ class Screen
     Surface m_surface;
 };
 
-class Object
+/// Decodes every voxel sprite exactly once and packs them into a single surface
+/// in the display's pixel format. Row 0 holds the terrain sprites, indexed by
+/// Terrain_Type, row 1 holds the feature sprites, indexed by Feature_Type.
+class Sprite_Atlas
 {
   public:
-    Object(const std::string &t_filename)
-      : m_surface(IMG_Load(t_filename.c_str()), &IMG_GetError)
+    Sprite_Atlas()
+      : m_loads(0), m_sprite_width(0), m_sprite_height(0), m_surface(create_atlas())
     {
     }
 
-    ~Object()
+    void render(Surface &t_surface, Terrain_Type t_terrain, int t_x, int t_y) const
     {
+      render(t_surface, t_terrain, 0, t_x, t_y);
     }
 
-    void render(Surface &t_surface, int t_x, int t_y) const
+    void render(Surface &t_surface, Feature_Type t_feature, int t_x, int t_y) const
+    {
+      if (t_feature != None)
+      {
+        render(t_surface, t_feature, 1, t_x, t_y);
+      }
+    }
+
+    /// Number of image files decoded since construction. Stays constant once
+    /// the atlas is built.
+    int loads() const
     {
-      m_surface.render(t_surface, t_x, t_y);
+      return m_loads;
     }
 
+    /// Size of every sprite, sprites may be larger than a tile and overlap
+    /// their neighbours
+    int sprite_width() const
+    {
+      return m_sprite_width;
+    }
+
+    int sprite_height() const
+    {
+      return m_sprite_height;
+    }
 
   private:
-    Object(const Object &);
-    Object &operator=(const Object &);
+    Sprite_Atlas(const Sprite_Atlas &);
+    Sprite_Atlas &operator=(const Sprite_Atlas &);
+
+    static const int num_columns = Forest + 1;
+
+    void render(Surface &t_surface, int t_column, int t_row, int t_x, int t_y) const
+    {
+      SDL_Rect source;
+      source.x = t_column * m_sprite_width;
+      source.y = t_row * m_sprite_height;
+      source.w = m_sprite_width;
+      source.h = m_sprite_height;
+
+      m_surface.render(t_surface, t_x, t_y, source);
+    }
+
+    std::shared_ptr<Surface> load(const std::string &t_filename)
+    {
+      ++m_loads;
+
+      Surface image(IMG_Load(t_filename.c_str()), &IMG_GetError);
+      std::shared_ptr<Surface> converted(new Surface(SDL_DisplayFormatAlpha(image.get())));
+
+      // copy the alpha channel into the atlas instead of blending with it
+      SDL_SetAlpha(converted->get(), 0, SDL_ALPHA_OPAQUE);
+      return converted;
+    }
+
+    SDL_Surface *create_atlas()
+    {
+      const char *terrain_files[num_columns] = { nullptr };
+      terrain_files[Mountain] = "mountainvoxel.png";
+      terrain_files[Plain] = "plainvoxel.png";
+      terrain_files[Water] = "watervoxel.png";
+      terrain_files[Swamp] = "swampvoxel.png";
+      terrain_files[Forest] = "forestvoxel.png";
+
+      const char *feature_files[num_columns] = { nullptr };
+      feature_files[Cave] = "cavevoxel.png";
+      feature_files[Town] = "townvoxel.png";
 
+      std::vector<std::shared_ptr<Surface>> sprites[2];
+
+      for (int column = 0; column < num_columns; ++column)
+      {
+        sprites[0].push_back(terrain_files[column] ? load(terrain_files[column]) : std::shared_ptr<Surface>());
+        sprites[1].push_back(feature_files[column] ? load(feature_files[column]) : std::shared_ptr<Surface>());
+      }
+
+      const SDL_PixelFormat *format = sprites[0][Mountain]->get()->format;
+      m_sprite_width = sprites[0][Mountain]->width();
+      m_sprite_height = sprites[0][Mountain]->height();
+
+      SDL_Surface *atlas = SDL_CreateRGBSurface(SDL_SWSURFACE, m_sprite_width * num_columns, m_sprite_height * 2,
+          format->BitsPerPixel, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+
+      if (!atlas)
+      {
+        return atlas;
+      }
+
+      for (int row = 0; row < 2; ++row)
+      {
+        for (int column = 0; column < num_columns; ++column)
+        {
+          if (sprites[row][column])
+          {
+            SDL_Rect dest;
+            dest.x = column * m_sprite_width;
+            dest.y = row * m_sprite_height;
+            dest.w = m_sprite_width;
+            dest.h = m_sprite_height;
+            SDL_BlitSurface(sprites[row][column]->get(), NULL, atlas, &dest);
+          }
+        }
+      }
+
+      SDL_SetAlpha(atlas, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
+      return atlas;
+    }
+
+    int m_loads;
+    int m_sprite_width;
+    int m_sprite_height;
     Surface m_surface;
 };
 
+/// Shows the current simulation snapshot through a screen sized camera that
+/// the arrow keys scroll across the map. Only tiles whose sprites reach into
+/// the viewport are read from the map and drawn, so the cost of a frame does
+/// not depend on the size of the map.
+///
+/// The visible tiles are composited into a background surface that persists
+/// between frames. While the camera stands still, each frame only the tiles
+/// that differ from what the background shows are drawn again, together with
+/// the overlapping parts of their neighbours, and only those rectangles are
+/// copied to the screen. Once the camera moves the whole viewport is redrawn.
+///
+/// Space pauses and resumes the simulation, '.' runs a single tick while
+/// paused, 'f' toggles fast forward, 't' dumps the profile, see
+/// write_profile(), and escape quits.
 class SDL_Engine
 {
   public:
-    SDL_Engine(const World &t_world)
-      : m_world(t_world.render(16,16,640/16,480/16,0))
+    SDL_Engine(const std::shared_ptr<World_Instance> &t_world, int t_screen_width, int t_screen_height)
+      : m_world(t_world),
+        m_screen(t_screen_width, t_screen_height),
+        m_background(create_background(m_screen.getSurface())),
+        m_camera_x(0), m_camera_y(0),
+        m_drawn_camera_x(-1), m_drawn_camera_y(-1),
+        m_drawn_first_x(0), m_drawn_first_y(0), m_drawn_columns(0),
+        m_quit(false)
     {
+      m_background.clear();
     }
 
 
+    /// Returns once the window is closed or escape is pressed
     void run()
     {
+      Profiler::set_thread_name("render");
       m_world->start();
 
-      typedef std::conditional<std::chrono::high_resolution_clock::is_monotonic, std::chrono::high_resolution_clock, std::chrono::monotonic_clock>::type clocktype;
+      typedef std::chrono::steady_clock clocktype;
 
-      clocktype::time_point t1 = clocktype::now();
+      clocktype::time_point last_input = clocktype::now();
 
-      while (true)
+      while (!m_quit)
       {
-        clocktype::time_point t2 = clocktype::now();
-        clocktype::duration frame_duration = t2 - t1;
+        const clocktype::time_point now = clocktype::now();
+        handle_events();
+        scroll(std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(now - last_input).count());
+        last_input = now;
 
-        t1 = t2;
+        std::shared_ptr<const Simulation> simulation = m_world->get_current_simulation();
+        clamp_camera(simulation->map);
 
-        double frame_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(frame_duration).count();
+        if (simulation == m_drawn_simulation && camera_x() == m_drawn_camera_x && camera_y() == m_drawn_camera_y)
+        {
+          // nothing was published and the camera did not move since the last frame
+          SDL_Delay(1);
+          continue;
+        }
 
-        render_sdl(m_screen, m_world->get_current_simulation());
+        const int loads = m_atlas.loads();
+        const size_t redrawn = render_sdl(m_screen, *simulation);
+        m_drawn_simulation = simulation;
 
-        std::cout << "SDL FPS: " <<  (1 / frame_ms) * 1000 << std::endl;
+        // both stay 0 per frame once the atlas is built and nothing changes
+        Profiler::count("SDL_Engine::asset_loads", std::uint64_t(m_atlas.loads() - loads));
+        Profiler::count("SDL_Engine::tiles_redrawn", redrawn);
       }
+
+      m_world->stop();
     }
 
-    void render_sdl(Screen &t_screen, const Simulation &t_simulation) const
+    /// Brings the screen up to date with t_simulation as seen from the
+    /// camera and returns the number of tiles drawn again
+    size_t render_sdl(Screen &t_screen, const Simulation &t_simulation)
     {
-      Object mountain("mountainvoxel.png");
-      Object swamp("swampvoxel.png");
-      Object water("watervoxel.png");
-      Object forest("forestvoxel.png");
-      Object plain("plainvoxel.png");
-      Object cave("cavevoxel.png");
-      Object town("townvoxel.png");
+      Scoped_Timer timer("SDL_Engine::render_sdl");
 
+      std::vector<SDL_Rect> dirty;
+      const size_t changed = update_background(t_simulation.map, dirty);
 
-      t_screen.getSurface().clear();
-
-      int width = t_simulation.map.num_horizontal();
-      int height = t_simulation.map.num_vertical();
+      for (SDL_Rect &rect: dirty)
+      {
+        m_background.render(t_screen.getSurface(), rect.x, rect.y, rect);
+      }
 
-      for (int x = 0; x < width; ++x)
+      if (!dirty.empty())
       {
-        for (int y = 0; y < height; ++y)
-        {
+        SDL_UpdateRects(t_screen.getSurface().get(), int(dirty.size()), dirty.data());
+      }
+
+      return changed;
+    }
 
-          int renderx = x * 16 - 4;
-          int rendery = y * 16 - 4;
+  private:
+    /// sprites are drawn this far up and left of their tile
+    static const int sprite_offset = 4;
 
+    /// camera speed while an arrow key is held, in pixels per millisecond
+    static double scroll_speed()
+    {
+      return 0.5;
+    }
 
-          switch (t_simulation.map.at(x,y).terrain_type)
+    static SDL_Surface *create_background(const Surface &t_screen)
+    {
+      const SDL_PixelFormat *format = t_screen.get()->format;
+      return SDL_CreateRGBSurface(SDL_SWSURFACE, int(t_screen.width()), int(t_screen.height()),
+          format->BitsPerPixel, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+    }
+
+    int camera_x() const
+    {
+      return int(m_camera_x);
+    }
+
+    int camera_y() const
+    {
+      return int(m_camera_y);
+    }
+
+    void handle_events()
+    {
+      SDL_Event event;
+
+      while (SDL_PollEvent(&event))
+      {
+        if (event.type == SDL_QUIT)
+        {
+          m_quit = true;
+        } else if (event.type == SDL_KEYDOWN) {
+          switch (event.key.keysym.sym)
           {
-            case Mountain:
-              mountain.render(t_screen.getSurface(), renderx, rendery);
+            case SDLK_ESCAPE:
+              m_quit = true;
+              break;
+            case SDLK_SPACE:
+              m_world->set_schedule_mode(m_world->schedule_mode() == Paused ? Fixed_Timestep : Paused);
               break;
-            case Swamp:
-              swamp.render(t_screen.getSurface(), renderx, rendery);
+            case SDLK_PERIOD:
+              m_world->step();
               break;
-            case Water:
-              water.render(t_screen.getSurface(), renderx, rendery);
+            case SDLK_f:
+              m_world->set_schedule_mode(m_world->schedule_mode() == Fast_Forward ? Fixed_Timestep : Fast_Forward);
               break;
-            case Forest:
-              forest.render(t_screen.getSurface(), renderx, rendery);
+            case SDLK_t:
+              write_profile();
               break;
-            case Plain:
-              plain.render(t_screen.getSurface(), renderx, rendery);
+            default:
               break;
-          };
+          }
+        }
+      }
+    }
+
+    /// Prints the simulation rate and tick latencies, the phase latencies and
+    /// the counters to stderr and writes the recent phases to trace_filename()
+    void write_profile() const
+    {
+      const char *mode_names[] = { "fixed", "paused", "fast forward" };
+      const Scheduler_Stats stats = m_world->scheduler_stats();
+
+      std::cerr << "Simulation (" << mode_names[stats.mode] << "): " << stats.ticks_per_second << " ticks/s, tick latency ms p50 "
+        << stats.latency_p50_ms << " p90 " << stats.latency_p90_ms << " p99 " << stats.latency_p99_ms
+        << " max " << stats.latency_max_ms << "\n";
+      Profiler::write_histograms(std::cerr);
+
+      try {
+        Profiler::write_chrome_trace(trace_filename());
+        std::cerr << "Trace written to " << trace_filename() << std::endl;
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+
+    static std::string trace_filename()
+    {
+      return "worldbuilder_trace.json";
+    }
+
+    /// Moves the camera for the arrow keys held over the last t_elapsed_ms
+    void scroll(double t_elapsed_ms)
+    {
+      const Uint8 *keys = SDL_GetKeyState(nullptr);
+      const double distance = scroll_speed() * t_elapsed_ms;
+
+      m_camera_x += (keys[SDLK_RIGHT] ? distance : 0) - (keys[SDLK_LEFT] ? distance : 0);
+      m_camera_y += (keys[SDLK_DOWN] ? distance : 0) - (keys[SDLK_UP] ? distance : 0);
+    }
+
+    /// Keeps the viewport on the map, maps smaller than the screen stay at the top left
+    void clamp_camera(const Map_Instance &t_map)
+    {
+      const double max_x = std::max(0.0, double(t_map.tile_width()) * t_map.num_horizontal() - m_background.width());
+      const double max_y = std::max(0.0, double(t_map.tile_height()) * t_map.num_vertical() - m_background.height());
+
+      m_camera_x = std::max(0.0, std::min(max_x, m_camera_x));
+      m_camera_y = std::max(0.0, std::min(max_y, m_camera_y));
+    }
+
+    /// Tiles [t_first_x, t_end_x) x [t_first_y, t_end_y) whose sprites reach
+    /// into t_rect of the viewport
+    void visible_tiles(const Map_Instance &t_map, const SDL_Rect &t_rect, int &t_first_x, int &t_end_x, int &t_first_y, int &t_end_y) const
+    {
+      const int tile_width = t_map.tile_width();
+      const int tile_height = t_map.tile_height();
+
+      // in map pixels, the sprite of tile x covers [x * tile_width - offset, + sprite_width)
+      const int left = camera_x() + t_rect.x + sprite_offset;
+      const int top = camera_y() + t_rect.y + sprite_offset;
+
+      t_first_x = std::max(0, (left - m_atlas.sprite_width()) / tile_width);
+      t_end_x = std::min(t_map.num_horizontal(), (left + t_rect.w + tile_width - 1) / tile_width);
+      t_first_y = std::max(0, (top - m_atlas.sprite_height()) / tile_height);
+      t_end_y = std::min(t_map.num_vertical(), (top + t_rect.h + tile_height - 1) / tile_height);
+    }
+
+    /// Redraws the whole viewport if the camera moved, otherwise compares
+    /// the visible tiles of t_map against the ones the background shows and
+    /// redraws every run of changed tiles on a row. The rectangles redrawn
+    /// are appended to t_dirty. Returns the number of tiles drawn again.
+    size_t update_background(const Map_Instance &t_map, std::vector<SDL_Rect> &t_dirty)
+    {
+      SDL_Rect viewport;
+      viewport.x = 0;
+      viewport.y = 0;
+      viewport.w = Uint16(m_background.width());
+      viewport.h = Uint16(m_background.height());
+
+      int first_x, end_x, first_y, end_y;
+      visible_tiles(t_map, viewport, first_x, end_x, first_y, end_y);
 
-          switch (t_simulation.map.at(x,y).feature_type)
+      const int columns = std::max(0, end_x - first_x);
+      const int rows = std::max(0, end_y - first_y);
+
+      if (camera_x() != m_drawn_camera_x || camera_y() != m_drawn_camera_y
+          || first_x != m_drawn_first_x || first_y != m_drawn_first_y || columns != m_drawn_columns
+          || size_t(columns) * rows != m_drawn_tiles.size())
+      {
+        m_drawn_camera_x = camera_x();
+        m_drawn_camera_y = camera_y();
+        m_drawn_first_x = first_x;
+        m_drawn_first_y = first_y;
+        m_drawn_columns = columns;
+        m_drawn_tiles.resize(size_t(columns) * rows);
+
+        for (int y = 0; y < rows; ++y)
+        {
+          for (int x = 0; x < columns; ++x)
           {
-            case Cave:
-              cave.render(t_screen.getSurface(), renderx, rendery);
-              break;
-            case Town:
-              town.render(t_screen.getSurface(), renderx, rendery);
-              break;
-            case None:
-              break;
+            m_drawn_tiles[size_t(y) * columns + x] = Map_Instance::pack(t_map.at(first_x + x, first_y + y));
           }
         }
+
+        redraw(t_map, viewport);
+        t_dirty.push_back(viewport);
+        return m_drawn_tiles.size();
       }
 
+      size_t changed = 0;
+
+      for (int y = 0; y < rows; ++y)
+      {
+        std::uint8_t *drawn = &m_drawn_tiles[size_t(y) * columns];
+        int run_start = -1;
+
+        for (int x = 0; x <= columns; ++x)
+        {
+          const std::uint8_t tile = x < columns ? Map_Instance::pack(t_map.at(first_x + x, first_y + y)) : 0;
+          const bool differs = x < columns && drawn[x] != tile;
 
-      t_screen.getSurface().flip();
+          if (differs)
+          {
+            drawn[x] = tile;
+            ++changed;
+
+            if (run_start < 0)
+            {
+              run_start = x;
+            }
+          } else if (run_start >= 0) {
+            SDL_Rect rect;
+            if (tile_rect(t_map, first_x + run_start, first_x + x, first_y + y, rect))
+            {
+              redraw(t_map, rect);
+              t_dirty.push_back(rect);
+            }
+            run_start = -1;
+          }
+        }
+      }
+
+      return changed;
+    }
+
+    /// Pixels of the viewport the sprites of tiles [t_first_x, t_end_x) of
+    /// row t_y draw to, clipped to the viewport. False if nothing is left.
+    bool tile_rect(const Map_Instance &t_map, int t_first_x, int t_end_x, int t_y, SDL_Rect &t_rect) const
+    {
+      const int left = std::max(0, t_first_x * t_map.tile_width() - sprite_offset - camera_x());
+      const int top = std::max(0, t_y * t_map.tile_height() - sprite_offset - camera_y());
+      const int right = std::min(int(m_background.width()), (t_end_x - 1) * t_map.tile_width() - sprite_offset + m_atlas.sprite_width() - camera_x());
+      const int bottom = std::min(int(m_background.height()), t_y * t_map.tile_height() - sprite_offset + m_atlas.sprite_height() - camera_y());
+
+      t_rect.x = Sint16(left);
+      t_rect.y = Sint16(top);
+      t_rect.w = Uint16(std::max(0, right - left));
+      t_rect.h = Uint16(std::max(0, bottom - top));
+      return right > left && bottom > top;
+    }
+
+    /// Clears t_rect of the background and draws every tile whose sprites
+    /// reach into it, clipped to it, in the same column by column order as a
+    /// full redraw so overlapping sprites stack the same way
+    void redraw(const Map_Instance &t_map, const SDL_Rect &t_rect)
+    {
+      SDL_Surface *surface = m_background.get();
+
+      SDL_SetClipRect(surface, &t_rect);
+
+      SDL_Rect fill = t_rect;
+      SDL_FillRect(surface, &fill, SDL_MapRGBA(surface->format, 0, 0, 0, SDL_ALPHA_TRANSPARENT));
+
+      int first_x, end_x, first_y, end_y;
+      visible_tiles(t_map, t_rect, first_x, end_x, first_y, end_y);
+
+      for (int x = first_x; x < end_x; ++x)
+      {
+        for (int y = first_y; y < end_y; ++y)
+        {
+          int renderx = x * t_map.tile_width() - sprite_offset - camera_x();
+          int rendery = y * t_map.tile_height() - sprite_offset - camera_y();
+
+          const Map_Instance::Map_Tile &tile = t_map.at(x,y);
+
+          m_atlas.render(m_background, tile.terrain_type, renderx, rendery);
+          m_atlas.render(m_background, tile.feature_type, renderx, rendery);
+        }
+      }
+
+      SDL_SetClipRect(surface, nullptr);
     }
 
-  private:
     std::shared_ptr<World_Instance> m_world;
     Screen m_screen;
-
+    Sprite_Atlas m_atlas; //< constructed after m_screen, conversion needs the video mode
+    Surface m_background; //< the viewport, as last drawn
+
+    double m_camera_x; //< top left of the viewport, in map pixels
+    double m_camera_y;
+
+    // what m_background shows
+    int m_drawn_camera_x;
+    int m_drawn_camera_y;
+    int m_drawn_first_x;
+    int m_drawn_first_y;
+    int m_drawn_columns;
+    std::vector<std::uint8_t> m_drawn_tiles; //< packed visible tiles, m_drawn_columns per row
+    std::shared_ptr<const Simulation> m_drawn_simulation;
+
+    bool m_quit;
 };
 
 #endif
@@ -0,0 +1,45 @@
+#include "Seed_Sweep.hpp"
+#include "Thread_Pool.hpp"
+
+World_Summary::World_Summary()
+  : seed(0), terrain_counts(), feature_counts()
+{
+}
+
+World_Summary summarize(int t_seed, const Map_Instance &t_map)
+{
+  World_Summary summary;
+  summary.seed = t_seed;
+
+  for (int y = 0; y < t_map.num_vertical(); ++y)
+  {
+    for (int x = 0; x < t_map.num_horizontal(); ++x)
+    {
+      const Map_Instance::Map_Tile tile = t_map.at(x, y);
+      ++summary.terrain_counts[tile.terrain_type];
+      ++summary.feature_counts[tile.feature_type];
+    }
+  }
+
+  return summary;
+}
+
+std::vector<World_Summary> sweep_seeds(const World &t_world, int t_first_seed, int t_num_seeds, int t_num_threads,
+    int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical)
+{
+  std::vector<World_Summary> summaries(t_num_seeds);
+
+  Thread_Pool pool(t_num_threads);
+
+  // whole worlds are the unit of work, there are plenty of them
+  pool.run(t_num_seeds,
+      [&](int t_index)
+      {
+        const int seed = t_first_seed + t_index;
+        summaries[t_index] = summarize(seed,
+            t_world.render_map(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, seed));
+      }
+    );
+
+  return summaries;
+}
@@ -0,0 +1,29 @@
+#ifndef WORLDBUILDER_SEED_SWEEP_HPP
+#define WORLDBUILDER_SEED_SWEEP_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "World.hpp"
+
+/// What one rendered world is made of, for picking good seeds without
+/// looking at every world
+struct World_Summary
+{
+  World_Summary();
+
+  int seed;
+  size_t terrain_counts[Forest + 1]; //< tiles of each Terrain_Type
+  size_t feature_counts[Town + 1];   //< tiles of each Feature_Type, None included
+};
+
+World_Summary summarize(int t_seed, const Map_Instance &t_map);
+
+/// Renders t_world for every seed in [t_first_seed, t_first_seed + t_num_seeds)
+/// with t_num_threads threads, one world per task, and returns the summaries
+/// in seed order. Each world renders on the thread of its task. Each world is
+/// dropped as soon as it is summarized.
+std::vector<World_Summary> sweep_seeds(const World &t_world, int t_first_seed, int t_num_seeds, int t_num_threads,
+    int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical);
+
+#endif
@@ -2,6 +2,72 @@
 #include "Region.hpp"
 #include "Point.hpp"
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+  // relative slack between the squared distance compare and the hypot() based
+  // Circle::contains(), generously above the few ulps either can be off by
+  const double edge_tolerance = 1e-12;
+
+  /// Area of the circle of radius t_r around the origin between x = t_x0 and
+  /// x = t_x1 above y = t_h, for t_h >= 0, by integrating sqrt(r^2 - x^2) - h
+  /// over the span of x where it is positive
+  double cap_area(double t_x0, double t_x1, double t_h, double t_r)
+  {
+    if (t_h >= t_r)
+    {
+      return 0;
+    }
+
+    const double half_chord = std::sqrt(t_r * t_r - t_h * t_h);
+
+    const auto integral = [&](double t_x)
+    {
+      const double x = std::max(-half_chord, std::min(half_chord, t_x));
+      const double s = std::max(-1.0, std::min(1.0, x / t_r));
+      return 0.5 * (x * std::sqrt(std::max(0.0, t_r * t_r - x * x)) + t_r * t_r * std::asin(s)) - t_h * x;
+    };
+
+    return integral(t_x1) - integral(t_x0);
+  }
+
+  /// Area of the circle of radius t_r around the origin inside the band
+  /// [t_x0, t_x1] x [t_y0, t_y1]. The circle is symmetric in y, so bands
+  /// below the x axis are mirrored above it.
+  double band_area(double t_x0, double t_x1, double t_y0, double t_y1, double t_r)
+  {
+    if (t_y1 <= 0)
+    {
+      return band_area(t_x0, t_x1, -t_y1, -t_y0, t_r);
+    }
+
+    if (t_y0 < 0)
+    {
+      return band_area(t_x0, t_x1, 0, -t_y0, t_r) + band_area(t_x0, t_x1, 0, t_y1, t_r);
+    }
+
+    return cap_area(t_x0, t_x1, t_y0, t_r) - cap_area(t_x0, t_x1, t_y1, t_r);
+  }
+}
+
+#if defined(__AVX__)
+const int Shape::batch_lanes = 4;
+#elif defined(__SSE2__)
+const int Shape::batch_lanes = 2;
+#else
+const int Shape::batch_lanes = 1;
+#endif
+
+Shape::Circle::Circle()
+  : center(0, 0), radius(0)
+{
+}
+
 Shape::Circle::Circle(const Point &t_center, double t_radius)
   : center(t_center), radius(t_radius)
 {
@@ -12,28 +78,135 @@ bool Shape::Circle::contains(const Point &t_p) const
   return t_p.distance(center) <= radius;
 }
 
-Shape::Shape(const Region &t_region, std::mt19937 &t_engine)
+double Shape::Circle::intersection_area(const Region &t_rect) const
+{
+  const Point top_left = t_rect.top_left();
+  const Point bottom_right = t_rect.bottom_right();
+
+  // nearest point of the rectangle, if that is outside nothing overlaps
+  const Point nearest(std::max(top_left.x, std::min(bottom_right.x, center.x)), std::max(top_left.y, std::min(bottom_right.y, center.y)));
+  if (nearest.distance_squared(center) >= radius * radius)
+  {
+    return 0;
+  }
+
+  // farthest corner, if that is inside the whole rectangle is
+  const Point farthest(std::max(center.x - top_left.x, bottom_right.x - center.x), std::max(center.y - top_left.y, bottom_right.y - center.y));
+  if (farthest.distance_squared(Point(0, 0)) <= radius * radius)
+  {
+    return t_rect.width() * t_rect.height();
+  }
+
+  return std::max(0.0, band_area(top_left.x - center.x, bottom_right.x - center.x, top_left.y - center.y, bottom_right.y - center.y, radius));
+}
+
+Shape::Shape(const Region &t_region, Random_Stream &t_random)
+  : m_num_circles(0)
 {
   double max_radius = std::min(t_region.width(), t_region.height());
 
-  int num_circles = std::uniform_int_distribution<int>(3, 6)(t_engine);
+  int num_circles = std::uniform_int_distribution<int>(3, max_circles)(t_random);
   std::uniform_real_distribution<double> radius(0, max_radius);
 
   for (int i = 0; i < num_circles; ++i)
   {
-    Point p = t_region.choose_point(t_engine);
-    double r = radius(t_engine);
+    Point p = t_region.choose_point(t_random);
+    double r = radius(t_random);
 
-    m_circles.push_back(Circle(p, r));
+    m_circles[i] = Circle(p, r);
+
+    m_center_x[i] = p.x;
+    m_center_y[i] = p.y;
+    m_inner_radius_squared[i] = r * r * (1 - edge_tolerance);
+    m_outer_radius_squared[i] = r * r * (1 + edge_tolerance);
   }
+
+  m_num_circles = num_circles;
 }
 
 
+Region Shape::bounding_box() const
+{
+  Point top_left(0, 0);
+  Point bottom_right(0, 0);
+
+  for (int i = 0; i < m_num_circles; ++i)
+  {
+    const Circle &circle = m_circles[i];
+
+    if (i == 0)
+    {
+      top_left = Point(circle.center.x - circle.radius, circle.center.y - circle.radius);
+      bottom_right = Point(circle.center.x + circle.radius, circle.center.y + circle.radius);
+    } else {
+      top_left = Point(std::min(top_left.x, circle.center.x - circle.radius), std::min(top_left.y, circle.center.y - circle.radius));
+      bottom_right = Point(std::max(bottom_right.x, circle.center.x + circle.radius), std::max(bottom_right.y, circle.center.y + circle.radius));
+    }
+  }
+
+  return Region(top_left, bottom_right);
+}
+
+void Shape::cover_row(double t_top, double t_bottom, int t_num_columns, double t_column_width, double *t_uncovered,
+    int &t_first, int &t_last) const
+{
+  t_first = t_num_columns;
+  t_last = -1;
+
+  const double tile_area = t_column_width * (t_bottom - t_top);
+
+  for (int c = 0; c < m_num_circles; ++c)
+  {
+    const Circle &circle = m_circles[c];
+
+    if (circle.center.y + circle.radius <= t_top || circle.center.y - circle.radius >= t_bottom)
+    {
+      continue;
+    }
+
+    const int first = std::max(0, int(std::floor((circle.center.x - circle.radius) / t_column_width)));
+    const int last = std::min(t_num_columns - 1, int(std::floor((circle.center.x + circle.radius) / t_column_width)));
+
+    // columns whose tile lies entirely inside the circle, found from the
+    // chord at whichever band edge is farther from the center
+    int inner_first = last + 1;
+    int inner_last = last;
+    if (circle.center.y - circle.radius <= t_top && circle.center.y + circle.radius >= t_bottom)
+    {
+      const double dy = std::max(std::fabs(t_top - circle.center.y), std::fabs(t_bottom - circle.center.y));
+      const double half_chord = std::sqrt(std::max(0.0, circle.radius * circle.radius - dy * dy));
+      inner_first = std::max(first, int(std::ceil((circle.center.x - half_chord) / t_column_width)) + 1);
+      inner_last = std::min(last, int(std::floor((circle.center.x + half_chord) / t_column_width)) - 2);
+    }
+
+    for (int x = first; x <= last; ++x)
+    {
+      if (x == inner_first && inner_first <= inner_last)
+      {
+        std::fill(t_uncovered + inner_first, t_uncovered + inner_last + 1, 0.0);
+        t_first = std::min(t_first, inner_first);
+        t_last = std::max(t_last, inner_last);
+        x = inner_last;
+        continue;
+      }
+
+      const double area = circle.intersection_area(Region(Point(x * t_column_width, t_top), Point((x + 1) * t_column_width, t_bottom)));
+
+      if (area > 0)
+      {
+        t_uncovered[x] *= 1 - std::min(1.0, area / tile_area);
+        t_first = std::min(t_first, x);
+        t_last = std::max(t_last, x);
+      }
+    }
+  }
+}
+
 bool Shape::contains(const Point &t_p) const
 {
-  for (const Circle &circle: m_circles)
+  for (int c = 0; c < m_num_circles; ++c)
   {
-    if (circle.contains(t_p))
+    if (m_circles[c].contains(t_p))
     {
       return true;
     }
@@ -43,3 +216,92 @@ bool Shape::contains(const Point &t_p) const
 }
 
 
+
+void Shape::classify_lanes(const double *t_x, const double *t_y, int &t_inside_mask, int &t_near_edge_mask) const
+{
+#if defined(__AVX__)
+  const __m256d x = _mm256_loadu_pd(t_x);
+  const __m256d y = _mm256_loadu_pd(t_y);
+  __m256d inside = _mm256_setzero_pd();
+  __m256d near_edge = _mm256_setzero_pd();
+
+  for (int c = 0; c < m_num_circles; ++c)
+  {
+    const __m256d dx = _mm256_sub_pd(x, _mm256_broadcast_sd(&m_center_x[c]));
+    const __m256d dy = _mm256_sub_pd(y, _mm256_broadcast_sd(&m_center_y[c]));
+    const __m256d distance_squared = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+
+    inside = _mm256_or_pd(inside, _mm256_cmp_pd(distance_squared, _mm256_broadcast_sd(&m_inner_radius_squared[c]), _CMP_LE_OQ));
+    near_edge = _mm256_or_pd(near_edge, _mm256_cmp_pd(distance_squared, _mm256_broadcast_sd(&m_outer_radius_squared[c]), _CMP_LE_OQ));
+  }
+
+  t_inside_mask = _mm256_movemask_pd(inside);
+  t_near_edge_mask = _mm256_movemask_pd(near_edge);
+#elif defined(__SSE2__)
+  const __m128d x = _mm_loadu_pd(t_x);
+  const __m128d y = _mm_loadu_pd(t_y);
+  __m128d inside = _mm_setzero_pd();
+  __m128d near_edge = _mm_setzero_pd();
+
+  for (int c = 0; c < m_num_circles; ++c)
+  {
+    const __m128d dx = _mm_sub_pd(x, _mm_set1_pd(m_center_x[c]));
+    const __m128d dy = _mm_sub_pd(y, _mm_set1_pd(m_center_y[c]));
+    const __m128d distance_squared = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+
+    inside = _mm_or_pd(inside, _mm_cmple_pd(distance_squared, _mm_set1_pd(m_inner_radius_squared[c])));
+    near_edge = _mm_or_pd(near_edge, _mm_cmple_pd(distance_squared, _mm_set1_pd(m_outer_radius_squared[c])));
+  }
+
+  t_inside_mask = _mm_movemask_pd(inside);
+  t_near_edge_mask = _mm_movemask_pd(near_edge);
+#else
+  t_inside_mask = 0;
+  t_near_edge_mask = 0;
+
+  for (int c = 0; c < m_num_circles; ++c)
+  {
+    const double distance_squared = Point(*t_x, *t_y).distance_squared(Point(m_center_x[c], m_center_y[c]));
+    t_inside_mask |= distance_squared <= m_inner_radius_squared[c];
+    t_near_edge_mask |= distance_squared <= m_outer_radius_squared[c];
+  }
+#endif
+}
+
+void Shape::contains_batch(const double *t_x, const double *t_y, int t_count, bool *t_inside) const
+{
+  for (int i = 0; i < t_count; i += batch_lanes)
+  {
+    const int lanes = std::min(batch_lanes, t_count - i);
+
+    int inside_mask = 0;
+    int near_edge_mask = 0;
+
+    if (lanes == batch_lanes)
+    {
+      classify_lanes(t_x + i, t_y + i, inside_mask, near_edge_mask);
+    } else {
+      // pad the tail to a full vector by repeating the last point
+      double x[batch_lanes];
+      double y[batch_lanes];
+      for (int lane = 0; lane < batch_lanes; ++lane)
+      {
+        x[lane] = t_x[i + std::min(lane, lanes - 1)];
+        y[lane] = t_y[i + std::min(lane, lanes - 1)];
+      }
+      classify_lanes(x, y, inside_mask, near_edge_mask);
+    }
+
+    for (int lane = 0; lane < lanes; ++lane)
+    {
+      if (inside_mask & (1 << lane))
+      {
+        t_inside[i + lane] = true;
+      } else if (near_edge_mask & (1 << lane)) {
+        t_inside[i + lane] = contains(Point(t_x[i + lane], t_y[i + lane]));
+      } else {
+        t_inside[i + lane] = false;
+      }
+    }
+  }
+}
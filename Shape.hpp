@@ -2,31 +2,150 @@
 #define WORLDBUILDER_SHAPE
 
 #include "Point.hpp"
+#include "Random.hpp"
 
-#include <vector>
 #include <random>
+#include <algorithm>
+#include <cmath>
 
 class Region;
 
 class Shape
 {
   public:
-    Shape(const Region &t_region, std::mt19937 &t_engine);
+    Shape(const Region &t_region, Random_Stream &t_random);
 
     bool contains(const Point &t_p) const;
 
+    /// Smallest axis aligned region holding every circle
+    Region bounding_box() const;
+
+    /// Sets t_inside[i] to contains(Point(t_x[i], t_y[i])) for every i in
+    /// [0, t_count). Compares squared distances against the structure of
+    /// arrays copy of the circles, several points per instruction where the
+    /// build targets SSE2 or AVX. Points within rounding distance of a circle
+    /// edge are settled with contains(), so the result is always identical.
+    void contains_batch(const double *t_x, const double *t_y, int t_count, bool *t_inside) const;
+
+    /// Scanline coverage of one row of a sampling grid. Calls t_fill(first,
+    /// last) with inclusive ranges of columns whose sample point lies inside
+    /// the shape. Ranges may overlap and together cover exactly the columns
+    /// a per column contains() query would.
+    ///
+    /// Each circle crossing the row gives an analytic span. Its columns more
+    /// than one column in from either end are filled as they are. The
+    /// columns around the span ends of all circles are settled together in
+    /// one contains_batch() call, so only a handful of points per circle are
+    /// tested.
+    ///
+    /// \param t_y             y of every sample point on the row
+    /// \param t_num_columns   number of columns on the row
+    /// \param t_column_width  distance between neighbouring sample points
+    /// \param t_sample        maps a column index to its sample point
+    template<typename Sample, typename Fill>
+      void rasterize_row(double t_y, int t_num_columns, double t_column_width, const Sample &t_sample, const Fill &t_fill) const
+      {
+        // the two columns either side of each span end
+        int edges[max_circles * 4];
+        double edge_x[max_circles * 4];
+        double edge_y[max_circles * 4];
+        bool inside[max_circles * 4];
+        int num_edges = 0;
+
+        for (int c = 0; c < m_num_circles; ++c)
+        {
+          const Circle &circle = m_circles[c];
+          const double dy = t_y - circle.center.y;
+
+          if (std::fabs(dy) > circle.radius)
+          {
+            continue;
+          }
+
+          const double half_chord = std::sqrt(std::max(0.0, circle.radius * circle.radius - dy * dy));
+
+          const int first = std::min(t_num_columns, std::max(-1, int(std::ceil((circle.center.x - half_chord) / t_column_width))));
+          const int last = std::max(-1, std::min(t_num_columns, int(std::floor((circle.center.x + half_chord) / t_column_width))));
+
+          if (std::max(first + 1, 0) <= std::min(last - 1, t_num_columns - 1))
+          {
+            t_fill(std::max(first + 1, 0), std::min(last - 1, t_num_columns - 1));
+          }
+
+          for (int column: { first - 1, first, last, last + 1 })
+          {
+            if (column >= 0 && column < t_num_columns && std::find(edges, edges + num_edges, column) == edges + num_edges)
+            {
+              const Point p = t_sample(column);
+              edges[num_edges] = column;
+              edge_x[num_edges] = p.x;
+              edge_y[num_edges] = p.y;
+              ++num_edges;
+            }
+          }
+        }
+
+        contains_batch(edge_x, edge_y, num_edges, inside);
+
+        for (int i = 0; i < num_edges; ++i)
+        {
+          if (inside[i])
+          {
+            t_fill(edges[i], edges[i]);
+          }
+        }
+      }
+
+    /// Coverage of one band of tiles. Tile c spans [c, c + 1) *
+    /// t_column_width horizontally and [t_top, t_bottom) vertically. For every
+    /// circle overlapping tile c, t_uncovered[c] is multiplied by the fraction
+    /// of the tile the circle leaves uncovered, from the exact circle and
+    /// rectangle intersection area. Starting from 1, 1 - t_uncovered[c] is then
+    /// the shape's coverage of the tile. That is exact wherever at most one
+    /// circle is partially over a tile, and otherwise treats the circles as
+    /// overlapping independently within the tile.
+    ///
+    /// t_first and t_last are set to the inclusive range of columns that were
+    /// touched, t_first > t_last if none were.
+    void cover_row(double t_top, double t_bottom, int t_num_columns, double t_column_width, double *t_uncovered,
+        int &t_first, int &t_last) const;
+
   private:
     struct Circle
     {
+      Circle();
       Circle(const Point &t_center, double t_radius);
 
       Point center;
       double radius;
 
       bool contains(const Point &t_p) const;
+
+      /// Area of the part of t_rect inside the circle, computed in closed form
+      double intersection_area(const Region &t_rect) const;
     };
 
-    std::vector<Circle> m_circles;
+    /// a shape has between 3 and max_circles circles, stored in place so that
+    /// building one does not allocate
+    static const int max_circles = 6;
+
+    int m_num_circles;
+    Circle m_circles[max_circles];
+
+    // structure of arrays copy of m_circles for contains_batch(). A squared
+    // distance at or below the inner bound is inside for certain, one above
+    // the outer bound is outside for certain.
+    double m_center_x[max_circles];
+    double m_center_y[max_circles];
+    double m_inner_radius_squared[max_circles];
+    double m_outer_radius_squared[max_circles];
+
+    /// points classify_lanes() handles at once, 4 with AVX, 2 with SSE2, 1 otherwise
+    static const int batch_lanes;
+
+    /// Classifies batch_lanes points against all circles. Bit i of the masks
+    /// refers to point i.
+    void classify_lanes(const double *t_x, const double *t_y, int &t_inside_mask, int &t_near_edge_mask) const;
 };
 
 #endif
@@ -0,0 +1,162 @@
+#include "Simulation_Scheduler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+Scheduler_Stats::Scheduler_Stats()
+  : mode(Fixed_Timestep), ticks(0), ticks_per_second(0),
+    latency_p50_ms(0), latency_p90_ms(0), latency_p99_ms(0), latency_max_ms(0)
+{
+}
+
+Simulation_Scheduler::Simulation_Scheduler(double t_tick_ms, int t_max_catch_up_ticks)
+  : m_tick_ms(t_tick_ms), m_max_catch_up_ticks(std::max(1, t_max_catch_up_ticks)),
+    m_mode(Fixed_Timestep), m_mode_changed(false), m_woken(false), m_pending_steps(0), m_stopped(false),
+    m_last_time(clocktype::now()), m_accumulator_ms(0),
+    m_interval_start(m_last_time)
+{
+}
+
+double Simulation_Scheduler::tick_ms() const
+{
+  return m_tick_ms;
+}
+
+void Simulation_Scheduler::set_mode(Schedule_Mode t_mode)
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  m_mode = t_mode;
+  m_mode_changed = true;
+  m_wakeup.notify_all();
+}
+
+Schedule_Mode Simulation_Scheduler::mode() const
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  return m_mode;
+}
+
+void Simulation_Scheduler::step()
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  ++m_pending_steps;
+  m_wakeup.notify_all();
+}
+
+void Simulation_Scheduler::start()
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  m_stopped = false;
+  m_woken = false;
+  m_last_time = clocktype::now();
+  m_accumulator_ms = 0;
+  m_interval_start = m_last_time;
+  m_latencies = Latency_Histogram();
+}
+
+void Simulation_Scheduler::stop()
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  m_stopped = true;
+  m_wakeup.notify_all();
+}
+
+void Simulation_Scheduler::wake()
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  m_woken = true;
+  m_wakeup.notify_all();
+}
+
+int Simulation_Scheduler::next_ticks()
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+
+  while (!m_stopped && !m_mode_changed && !m_woken)
+  {
+    switch (m_mode)
+    {
+      case Paused:
+        if (m_pending_steps > 0)
+        {
+          --m_pending_steps;
+          return 1;
+        }
+        m_wakeup.wait(l);
+        break;
+
+      case Fast_Forward:
+        m_last_time = clocktype::now();
+        m_accumulator_ms = 0;
+        return 1;
+
+      case Fixed_Timestep:
+        {
+          const clocktype::time_point now = clocktype::now();
+          m_accumulator_ms += std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(now - m_last_time).count();
+          m_last_time = now;
+
+          // drop backlog beyond the catch up limit instead of spiraling
+          m_accumulator_ms = std::min(m_accumulator_ms, m_tick_ms * m_max_catch_up_ticks);
+
+          const int ticks = int(std::floor(m_accumulator_ms / m_tick_ms));
+          if (ticks > 0)
+          {
+            m_accumulator_ms -= ticks * m_tick_ms;
+            return ticks;
+          }
+
+          m_wakeup.wait_until(l, now + std::chrono::duration_cast<clocktype::duration>(
+                std::chrono::duration<double, std::milli>(m_tick_ms - m_accumulator_ms)));
+        }
+        break;
+    }
+  }
+
+  if (m_mode_changed)
+  {
+    // do not make up for the time spent in another mode
+    m_mode_changed = false;
+    m_last_time = clocktype::now();
+    m_accumulator_ms = 0;
+  }
+
+  m_woken = false;
+  return 0;
+}
+
+void Simulation_Scheduler::tick_done(double t_latency_ms)
+{
+  m_latencies.add(std::uint64_t(std::max(0.0, t_latency_ms) * 1e6));
+}
+
+bool Simulation_Scheduler::update_stats(double t_interval_ms)
+{
+  const clocktype::time_point now = clocktype::now();
+  const double elapsed_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(now - m_interval_start).count();
+
+  if (elapsed_ms < t_interval_ms)
+  {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> l(m_mutex);
+
+  m_stats.mode = m_mode;
+  m_stats.ticks = long(m_latencies.count);
+  m_stats.ticks_per_second = m_stats.ticks * 1000.0 / elapsed_ms;
+  m_stats.latency_p50_ms = m_latencies.percentile_ms(0.50);
+  m_stats.latency_p90_ms = m_latencies.percentile_ms(0.90);
+  m_stats.latency_p99_ms = m_latencies.percentile_ms(0.99);
+  m_stats.latency_max_ms = m_latencies.max_ns / 1e6;
+
+  m_latencies = Latency_Histogram();
+  m_interval_start = now;
+  return true;
+}
+
+Scheduler_Stats Simulation_Scheduler::stats() const
+{
+  std::unique_lock<std::mutex> l(m_mutex);
+  return m_stats;
+}
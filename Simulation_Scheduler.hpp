@@ -0,0 +1,101 @@
+#ifndef WORLDBUILDER_SIMULATION_SCHEDULER_HPP
+#define WORLDBUILDER_SIMULATION_SCHEDULER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "Profiler.hpp"
+
+enum Schedule_Mode
+{
+  Fixed_Timestep, //< ticks at a fixed rate, catching up on missed ticks up to a limit
+  Paused,         //< only ticks when step() is called
+  Fast_Forward    //< ticks as fast as the CPU allows
+};
+
+struct Scheduler_Stats
+{
+  Scheduler_Stats();
+
+  Schedule_Mode mode;
+  long ticks;               //< ticks in the measured interval
+  double ticks_per_second;  //< achieved, in wall clock time
+  double latency_p50_ms;    //< time spent inside a tick, bucketed as in Latency_Histogram
+  double latency_p90_ms;
+  double latency_p99_ms;
+  double latency_max_ms;
+};
+
+/// Decides when the simulation thread ticks. Every tick advances simulated
+/// time by the same tick length regardless of mode, so a run is reproducible
+/// no matter how fast it is played back. Mode changes, steps and stop() may
+/// come from any thread, the rest is for the simulation thread.
+class Simulation_Scheduler
+{
+  public:
+    /// \param t_tick_ms             simulated time per tick
+    /// \param t_max_catch_up_ticks  most ticks run back to back after the
+    ///                              simulation fell behind, older backlog is dropped
+    Simulation_Scheduler(double t_tick_ms, int t_max_catch_up_ticks);
+
+    Simulation_Scheduler(const Simulation_Scheduler &) = delete;
+    Simulation_Scheduler &operator=(const Simulation_Scheduler &) = delete;
+
+    double tick_ms() const;
+
+    void set_mode(Schedule_Mode t_mode);
+    Schedule_Mode mode() const;
+
+    /// Runs one more tick while paused
+    void step();
+
+    /// Undoes stop() and restarts the tick clock, for a new simulation thread
+    void start();
+
+    /// Wakes up a waiting next_ticks() until the next start()
+    void stop();
+
+    /// Wakes up a waiting next_ticks() once, for work outside of ticks
+    void wake();
+
+    /// Blocks until ticks are due and returns how many to run back to back.
+    /// Returns 0 once stopped, once after every mode change and once after
+    /// every wake(), so the caller gets a chance to catch up with the new mode
+    /// or other work before it blocks again.
+    int next_ticks();
+
+    /// Records how long the tick that just finished took, without locking
+    void tick_done(double t_latency_ms);
+
+    /// Closes the current measurement interval once t_interval_ms of wall
+    /// clock time have passed, only locking then. Returns true if it did, the
+    /// results are then available from stats().
+    bool update_stats(double t_interval_ms);
+
+    /// Results of the last closed measurement interval
+    Scheduler_Stats stats() const;
+
+  private:
+    typedef std::chrono::steady_clock clocktype;
+
+    const double m_tick_ms;
+    const int m_max_catch_up_ticks;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    Schedule_Mode m_mode;
+    bool m_mode_changed;
+    bool m_woken;
+    int m_pending_steps;
+    bool m_stopped;
+
+    clocktype::time_point m_last_time;
+    double m_accumulator_ms;
+
+    clocktype::time_point m_interval_start; //< simulation thread only
+    Latency_Histogram m_latencies; //< simulation thread only
+    Scheduler_Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "Terrain_Coverage.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+Terrain_Coverage::Terrain_Coverage(int t_num_horizontal, int t_num_vertical, Terrain_Type t_background)
+  : m_num_horizontal(t_num_horizontal), m_num_vertical(t_num_vertical),
+    m_coverage(size_t(t_num_horizontal) * t_num_vertical * num_terrains)
+{
+  for (size_t i = t_background; i < m_coverage.size(); i += num_terrains)
+  {
+    m_coverage[i] = 255;
+  }
+}
+
+size_t Terrain_Coverage::index(int x, int y) const
+{
+  if (x >= m_num_horizontal || y >= m_num_vertical || x < 0 || y < 0)
+  {
+    throw std::range_error("Outside of map range");
+  }
+
+  return (size_t(y) * m_num_horizontal + x) * num_terrains;
+}
+
+double Terrain_Coverage::coverage(int x, int y, Terrain_Type t_terrain) const
+{
+  return m_coverage[index(x, y) + t_terrain] / 255.0;
+}
+
+Terrain_Type Terrain_Coverage::dominant(int x, int y) const
+{
+  const std::uint8_t *fractions = m_coverage.data() + index(x, y);
+  return Terrain_Type(std::max_element(fractions, fractions + num_terrains) - fractions);
+}
+
+void Terrain_Coverage::set(int x, int y, const double *t_fractions)
+{
+  quantize(t_fractions, num_terrains, m_coverage.data() + index(x, y));
+}
+
+void Terrain_Coverage::set_row(int y, const double *t_fractions)
+{
+  quantize(t_fractions, size_t(m_num_horizontal) * num_terrains, m_coverage.data() + index(0, y));
+}
+
+void Terrain_Coverage::quantize(const double *t_fractions, size_t t_count, std::uint8_t *t_coverage)
+{
+  for (size_t i = 0; i < t_count; ++i)
+  {
+    t_coverage[i] = std::uint8_t(std::max(0.0, std::min(1.0, t_fractions[i])) * 255 + 0.5);
+  }
+}
+
+int Terrain_Coverage::num_horizontal() const
+{
+  return m_num_horizontal;
+}
+
+int Terrain_Coverage::num_vertical() const
+{
+  return m_num_vertical;
+}
+
@@ -0,0 +1,51 @@
+#ifndef WORLDBUILDER_TERRAIN_COVERAGE_HPP
+#define WORLDBUILDER_TERRAIN_COVERAGE_HPP
+
+#include "Map.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/// How much of every tile each terrain covers, for blending terrain borders
+/// instead of giving each tile the terrain under its one sample point. See
+/// Map::render_coverage().
+///
+/// Fractions are stored one byte per terrain and tile, in steps of 1 / 255.
+class Terrain_Coverage
+{
+  public:
+    static const int num_terrains = Forest + 1;
+
+    /// Every tile fully covered by t_background
+    Terrain_Coverage(int t_num_horizontal, int t_num_vertical, Terrain_Type t_background);
+
+    /// Fraction of tile (x, y) covered by t_terrain, between 0 and 1. Throws
+    /// std::range_error if the tile is not on the map.
+    double coverage(int x, int y, Terrain_Type t_terrain) const;
+
+    /// Terrain covering the largest part of tile (x, y)
+    Terrain_Type dominant(int x, int y) const;
+
+    /// Sets every terrain's fraction of tile (x, y), t_fractions is indexed
+    /// by Terrain_Type
+    void set(int x, int y, const double *t_fractions);
+
+    /// set() for every tile of row y, num_terrains fractions per tile
+    void set_row(int y, const double *t_fractions);
+
+    int num_horizontal() const;
+    int num_vertical() const;
+
+  private:
+    /// Offset of tile (x, y) in m_coverage, throws std::range_error if it is not on the map
+    size_t index(int x, int y) const;
+
+    static void quantize(const double *t_fractions, size_t t_count, std::uint8_t *t_coverage);
+
+    int m_num_horizontal;
+    int m_num_vertical;
+    std::vector<std::uint8_t> m_coverage; //< num_terrains bytes per tile, row by row
+};
+
+#endif
+
@@ -0,0 +1,417 @@
+#include "Territory.hpp"
+#include "Profiler.hpp"
+#include "Thread_Pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+namespace
+{
+  /// tiles of one distance bucket relaxed per task
+  const size_t bucket_chunk_size = 4096;
+
+  /// Up to this many sources every tile simply checks all of them, which is
+  /// exact. Measured at 256x256 and 1024x1024, jump flooding only gets
+  /// faster somewhere between 64 and 100 sources.
+  const size_t direct_scan_sources = 64;
+
+  /// Travel cost in the high and owner in the low half, so that the smaller
+  /// value is the nearer source and, at equal cost, the one listed first
+  std::uint64_t pack(std::uint32_t t_cost, std::uint32_t t_owner)
+  {
+    return (std::uint64_t(t_cost) << 32) | t_owner;
+  }
+
+  /// Stores t_value in t_cell if it is smaller, returns whether it was
+  bool lower(std::atomic<std::uint64_t> &t_cell, std::uint64_t t_value)
+  {
+    std::uint64_t current = t_cell.load(std::memory_order_relaxed);
+
+    while (t_value < current)
+    {
+      if (t_cell.compare_exchange_weak(current, t_value, std::memory_order_relaxed))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void check_sources(const Map_Instance &t_map, const std::vector<Map_Position> &t_sources)
+  {
+    for (const Map_Position &source: t_sources)
+    {
+      if (source.x < 0 || source.y < 0 || source.x >= t_map.num_horizontal() || source.y >= t_map.num_vertical())
+      {
+        throw std::range_error("Source outside of map range");
+      }
+    }
+  }
+}
+
+const int Territory::unowned;
+const std::uint32_t Territory::unreached;
+
+Territory::Territory(int t_num_horizontal, int t_num_vertical, size_t t_num_sources, Metric t_metric)
+  : m_num_horizontal(t_num_horizontal), m_num_vertical(t_num_vertical), m_num_sources(t_num_sources), m_metric(t_metric),
+    m_owners(size_t(t_num_horizontal) * t_num_vertical, unowned),
+    m_distances(size_t(t_num_horizontal) * t_num_vertical, unreached)
+{
+}
+
+std::vector<Map_Position> Territory::town_positions(const Map_Instance &t_map)
+{
+  std::vector<Map_Position> positions;
+
+  for (int y = 0; y < t_map.num_vertical(); ++y)
+  {
+    for (int x = 0; x < t_map.num_horizontal(); ++x)
+    {
+      if (t_map.at(x, y).feature_type == Town)
+      {
+        positions.push_back(Map_Position(x, y));
+      }
+    }
+  }
+
+  return positions;
+}
+
+Territory Territory::nearest_euclidean(const Map_Instance &t_map, const std::vector<Map_Position> &t_sources,
+    int t_num_threads)
+{
+  check_sources(t_map, t_sources);
+
+  Scoped_Timer timer("Territory::nearest_euclidean");
+
+  const int width = t_map.num_horizontal();
+  const int height = t_map.num_vertical();
+
+  Territory territory(width, height, t_sources.size(), Euclidean_Distance);
+
+  const auto distance_squared = [&](int x, int y, std::int32_t t_source)
+  {
+    const std::int64_t dx = x - t_sources[t_source].x;
+    const std::int64_t dy = y - t_sources[t_source].y;
+    return std::uint32_t(dx * dx + dy * dy);
+  };
+
+  Thread_Pool pool(t_num_threads);
+  const int num_bands = std::max(1, std::min(height, pool.num_threads() * 4));
+
+  if (t_sources.size() <= direct_scan_sources)
+  {
+    pool.run(num_bands,
+        [&](int t_band)
+        {
+          for (int y = height * t_band / num_bands; y < height * (t_band + 1) / num_bands; ++y)
+          {
+            for (int x = 0; x < width; ++x)
+            {
+              const size_t tile = size_t(y) * width + x;
+
+              for (size_t source = 0; source < t_sources.size(); ++source)
+              {
+                const std::uint32_t source_distance = distance_squared(x, y, std::int32_t(source));
+                if (source_distance < territory.m_distances[tile])
+                {
+                  territory.m_owners[tile] = std::int32_t(source);
+                  territory.m_distances[tile] = source_distance;
+                }
+              }
+            }
+          }
+        });
+
+    return territory;
+  }
+
+  std::vector<std::int32_t> &seeds = territory.m_owners;
+  std::vector<std::int32_t> next(seeds.size(), unowned);
+
+  for (size_t source = 0; source < t_sources.size(); ++source)
+  {
+    std::int32_t &seed = seeds[territory.index(t_sources[source].x, t_sources[source].y)];
+    if (seed == unowned)
+    {
+      seed = std::int32_t(source);
+    }
+  }
+
+  // halving steps from half the map size down to 1, then one more pass of
+  // 1 which catches most of the tiles the halving alone gets wrong
+  std::vector<int> steps;
+  int step = 1;
+  while (step * 2 < std::max(width, height))
+  {
+    step *= 2;
+  }
+  for (; step >= 1; step /= 2)
+  {
+    steps.push_back(step);
+  }
+  steps.push_back(1);
+
+  for (int k: steps)
+  {
+    pool.run(num_bands,
+        [&](int t_band)
+        {
+          for (int y = height * t_band / num_bands; y < height * (t_band + 1) / num_bands; ++y)
+          {
+            for (int x = 0; x < width; ++x)
+            {
+              std::int32_t best = seeds[size_t(y) * width + x];
+              std::uint32_t best_distance = best == unowned ? unreached : distance_squared(x, y, best);
+
+              for (int ny = std::max(y - k, y % k); ny < std::min(y + k + 1, height); ny += k)
+              {
+                const std::int32_t *row = &seeds[size_t(ny) * width];
+
+                for (int nx = std::max(x - k, x % k); nx < std::min(x + k + 1, width); nx += k)
+                {
+                  const std::int32_t candidate = row[nx];
+                  if (candidate == unowned || candidate == best)
+                  {
+                    continue;
+                  }
+
+                  const std::uint32_t candidate_distance = distance_squared(x, y, candidate);
+                  if (candidate_distance < best_distance || (candidate_distance == best_distance && candidate < best))
+                  {
+                    best = candidate;
+                    best_distance = candidate_distance;
+                  }
+                }
+              }
+
+              next[size_t(y) * width + x] = best;
+            }
+          }
+        });
+
+    seeds.swap(next);
+  }
+
+  pool.run(num_bands,
+      [&](int t_band)
+      {
+        for (int y = height * t_band / num_bands; y < height * (t_band + 1) / num_bands; ++y)
+        {
+          for (int x = 0; x < width; ++x)
+          {
+            const size_t tile = size_t(y) * width + x;
+            if (seeds[tile] != unowned)
+            {
+              territory.m_distances[tile] = distance_squared(x, y, seeds[tile]);
+            }
+          }
+        }
+      });
+
+  return territory;
+}
+
+Territory Territory::nearest_by_cost(const Map_Instance &t_map, const std::vector<Map_Position> &t_sources,
+    int t_num_threads)
+{
+  check_sources(t_map, t_sources);
+
+  Scoped_Timer timer("Territory::nearest_by_cost");
+
+  const int width = t_map.num_horizontal();
+  const int height = t_map.num_vertical();
+  const size_t num_tiles = size_t(width) * height;
+
+  Territory territory(width, height, t_sources.size(), Travel_Cost);
+
+  std::vector<std::uint8_t> costs(num_tiles);
+  for (int y = 0; y < height; ++y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      costs[size_t(y) * width + x] = std::uint8_t(Pathfinder::terrain_cost(t_map.at(x, y).terrain_type));
+    }
+  }
+
+  int max_cost = 0;
+  for (int terrain = 0; terrain <= Forest; ++terrain)
+  {
+    max_cost = std::max(max_cost, Pathfinder::terrain_cost(Terrain_Type(terrain)));
+  }
+
+  // Reaching a tile costs at most max_cost more than the tile it is reached
+  // from, so the tiles still to be settled always fit into max_cost + 1
+  // buckets used as a ring.
+  const int num_buckets = max_cost + 1;
+  std::vector<std::vector<int>> buckets(num_buckets);
+
+  std::unique_ptr<std::atomic<std::uint64_t>[]> cells(new std::atomic<std::uint64_t>[num_tiles]);
+  for (size_t tile = 0; tile < num_tiles; ++tile)
+  {
+    cells[tile].store(pack(unreached, unreached), std::memory_order_relaxed);
+  }
+
+  for (size_t source = 0; source < t_sources.size(); ++source)
+  {
+    const int tile = t_sources[source].y * width + t_sources[source].x;
+    if (lower(cells[tile], pack(0, std::uint32_t(source))))
+    {
+      buckets[0].push_back(tile);
+    }
+  }
+
+  Thread_Pool pool(t_num_threads);
+
+  // tiles reached by every task, by the cost of the step that reached them
+  std::vector<std::vector<std::vector<int>>> reached;
+
+  size_t pending = buckets[0].size();
+
+  for (std::uint32_t cost = 0; pending; ++cost)
+  {
+    std::vector<int> &bucket = buckets[cost % num_buckets];
+    pending -= bucket.size();
+
+    const int num_tasks = int((bucket.size() + bucket_chunk_size - 1) / bucket_chunk_size);
+    if (reached.size() < size_t(num_tasks))
+    {
+      reached.resize(num_tasks, std::vector<std::vector<int>>(num_buckets));
+    }
+
+    // Everything in this bucket was settled by cheaper buckets, so its tiles
+    // can be relaxed in any order. Competing proposals for a neighbour are
+    // resolved by keeping the smallest packed value.
+    pool.run(num_tasks,
+        [&](int t_task)
+        {
+          const size_t end = std::min(bucket.size(), (t_task + 1) * bucket_chunk_size);
+
+          for (size_t i = t_task * bucket_chunk_size; i < end; ++i)
+          {
+            const int tile = bucket[i];
+            const std::uint64_t cell = cells[tile].load(std::memory_order_relaxed);
+
+            // reached again more cheaply after it was queued here
+            if (cell >> 32 != cost)
+            {
+              continue;
+            }
+
+            const std::uint32_t owner = std::uint32_t(cell);
+            const int x = tile % width;
+            const int y = tile / width;
+            const int neighbours[] = { x > 0 ? tile - 1 : -1, x + 1 < width ? tile + 1 : -1,
+              y > 0 ? tile - width : -1, y + 1 < height ? tile + width : -1 };
+
+            for (int neighbour: neighbours)
+            {
+              if (neighbour < 0 || !costs[neighbour])
+              {
+                continue;
+              }
+
+              if (lower(cells[neighbour], pack(cost + costs[neighbour], owner)))
+              {
+                reached[t_task][costs[neighbour]].push_back(neighbour);
+              }
+            }
+          }
+        });
+
+    bucket.clear();
+
+    for (int task = 0; task < num_tasks; ++task)
+    {
+      for (int step = 1; step < num_buckets; ++step)
+      {
+        std::vector<int> &tiles = reached[task][step];
+        std::vector<int> &target = buckets[(cost + step) % num_buckets];
+
+        target.insert(target.end(), tiles.begin(), tiles.end());
+        pending += tiles.size();
+        tiles.clear();
+      }
+    }
+  }
+
+  for (size_t tile = 0; tile < num_tiles; ++tile)
+  {
+    const std::uint64_t cell = cells[tile].load(std::memory_order_relaxed);
+
+    if (std::uint32_t(cell >> 32) != unreached)
+    {
+      territory.m_owners[tile] = std::int32_t(std::uint32_t(cell));
+      territory.m_distances[tile] = std::uint32_t(cell >> 32);
+    }
+  }
+
+  return territory;
+}
+
+size_t Territory::index(int x, int y) const
+{
+  if (x < 0 || y < 0 || x >= m_num_horizontal || y >= m_num_vertical)
+  {
+    throw std::range_error("Outside of map range");
+  }
+
+  return size_t(y) * m_num_horizontal + x;
+}
+
+int Territory::owner(int x, int y) const
+{
+  return m_owners[index(x, y)];
+}
+
+double Territory::distance(int x, int y) const
+{
+  const std::uint32_t distance = m_distances[index(x, y)];
+
+  if (distance == unreached)
+  {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  return m_metric == Euclidean_Distance ? std::sqrt(double(distance)) : double(distance);
+}
+
+std::vector<size_t> Territory::tile_counts() const
+{
+  std::vector<size_t> counts(m_num_sources, 0);
+
+  for (std::int32_t owner: m_owners)
+  {
+    if (owner != unowned)
+    {
+      ++counts[owner];
+    }
+  }
+
+  return counts;
+}
+
+Territory::Metric Territory::metric() const
+{
+  return m_metric;
+}
+
+int Territory::num_horizontal() const
+{
+  return m_num_horizontal;
+}
+
+int Territory::num_vertical() const
+{
+  return m_num_vertical;
+}
+
+size_t Territory::num_sources() const
+{
+  return m_num_sources;
+}
@@ -0,0 +1,85 @@
+#ifndef WORLDBUILDER_TERRITORY_HPP
+#define WORLDBUILDER_TERRITORY_HPP
+
+#include "Map.hpp"
+#include "Pathfinder.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/// Every tile of a map assigned to its nearest source, usually the towns, for
+/// influence, ownership and per region statistics. Ties go to the source
+/// listed first.
+///
+/// Both partitions are computed for all sources at once instead of searching
+/// from every tile, and split their work over a Thread_Pool. The result does
+/// not depend on the number of threads.
+class Territory
+{
+  public:
+    enum Metric
+    {
+      Euclidean_Distance,
+      Travel_Cost
+    };
+
+    static const int unowned = -1;
+
+    /// Every tile of t_map holding a Town, row by row
+    static std::vector<Map_Position> town_positions(const Map_Instance &t_map);
+
+    /// Nearest source by straight line distance between tile centres. Up to
+    /// 64 sources every tile checks all of them, which is exact. With more,
+    /// by jump flooding: about log2 of the map size passes over all tiles,
+    /// each looking at 9 tiles. That is not guaranteed exact, a tile where
+    /// two sources are nearly equidistant can go to the slightly farther one.
+    /// Every tile is owned if there is at least one source.
+    ///
+    /// Throws std::range_error if a source is not on the map.
+    static Territory nearest_euclidean(const Map_Instance &t_map, const std::vector<Map_Position> &t_sources,
+        int t_num_threads = 1);
+
+    /// Nearest source by the cheapest route, moving as Pathfinder does. Exact,
+    /// by a Dijkstra from all sources at once that keeps tiles in buckets by
+    /// distance instead of a heap, terrain costs being small integers. The
+    /// tiles of one bucket are relaxed in parallel. Tiles no source can reach
+    /// are unowned.
+    ///
+    /// Throws std::range_error if a source is not on the map.
+    static Territory nearest_by_cost(const Map_Instance &t_map, const std::vector<Map_Position> &t_sources,
+        int t_num_threads = 1);
+
+    /// Index into the sources of the owner of tile (x, y), or unowned. Throws
+    /// std::range_error if the tile is not on the map.
+    int owner(int x, int y) const;
+
+    /// Distance in tiles or travel cost from tile (x, y) to its owner,
+    /// infinity if unowned. Throws std::range_error if the tile is not on the
+    /// map.
+    double distance(int x, int y) const;
+
+    /// Number of tiles owned by every source
+    std::vector<size_t> tile_counts() const;
+
+    Metric metric() const;
+    int num_horizontal() const;
+    int num_vertical() const;
+    size_t num_sources() const;
+
+  private:
+    Territory(int t_num_horizontal, int t_num_vertical, size_t t_num_sources, Metric t_metric);
+
+    /// Offset of tile (x, y) in the layers, throws std::range_error if it is not on the map
+    size_t index(int x, int y) const;
+
+    static const std::uint32_t unreached = 0xffffffff;
+
+    int m_num_horizontal;
+    int m_num_vertical;
+    size_t m_num_sources;
+    Metric m_metric;
+    std::vector<std::int32_t> m_owners; //< row by row
+    std::vector<std::uint32_t> m_distances; //< squared distance in tiles for Euclidean_Distance, travel cost otherwise
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "Thread_Pool.hpp"
+
+#include <algorithm>
+
+namespace
+{
+  std::uint64_t make_range(int t_begin, int t_end)
+  {
+    return (std::uint64_t(std::uint32_t(t_begin)) << 32) | std::uint32_t(t_end);
+  }
+
+  int range_begin(std::uint64_t t_range)
+  {
+    return int(std::uint32_t(t_range >> 32));
+  }
+
+  int range_end(std::uint64_t t_range)
+  {
+    return int(std::uint32_t(t_range));
+  }
+}
+
+Thread_Pool::Thread_Pool(int t_num_threads)
+  : m_task(nullptr), m_slices(new Task_Slice[std::max(1, t_num_threads)]), m_active_workers(0), m_generation(0), m_stop(false)
+{
+  for (int i = 1; i < t_num_threads; ++i)
+  {
+    m_slices[i].range = 0;
+    m_threads.push_back(std::thread(&Thread_Pool::work, this, i));
+  }
+
+  m_slices[0].range = 0;
+}
+
+Thread_Pool::~Thread_Pool()
+{
+  {
+    std::unique_lock<std::mutex> l(m_mutex);
+    m_stop = true;
+  }
+
+  m_start.notify_all();
+
+  for (auto &thread: m_threads)
+  {
+    thread.join();
+  }
+}
+
+int Thread_Pool::num_threads() const
+{
+  return int(m_threads.size()) + 1;
+}
+
+void Thread_Pool::run(int t_num_tasks, const std::function<void (int)> &t_task)
+{
+  const int slots = num_threads();
+
+  {
+    std::unique_lock<std::mutex> l(m_mutex);
+    m_task = &t_task;
+
+    for (int i = 0; i < slots; ++i)
+    {
+      m_slices[i].range = make_range(int(std::int64_t(t_num_tasks) * i / slots), int(std::int64_t(t_num_tasks) * (i + 1) / slots));
+    }
+
+    m_active_workers = int(m_threads.size());
+    m_exception = std::exception_ptr();
+    ++m_generation;
+  }
+
+  m_start.notify_all();
+
+  run_tasks(0);
+
+  std::unique_lock<std::mutex> l(m_mutex);
+  while (m_active_workers > 0)
+  {
+    m_done.wait(l);
+  }
+
+  m_task = nullptr;
+
+  if (m_exception)
+  {
+    std::rethrow_exception(m_exception);
+  }
+}
+
+bool Thread_Pool::take_front(int t_slot, int &t_task)
+{
+  std::uint64_t range = m_slices[t_slot].range.load();
+
+  while (range_begin(range) < range_end(range))
+  {
+    if (m_slices[t_slot].range.compare_exchange_weak(range, make_range(range_begin(range) + 1, range_end(range))))
+    {
+      t_task = range_begin(range);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Thread_Pool::take_back(int t_slot, int &t_task)
+{
+  std::uint64_t range = m_slices[t_slot].range.load();
+
+  while (range_begin(range) < range_end(range))
+  {
+    if (m_slices[t_slot].range.compare_exchange_weak(range, make_range(range_begin(range), range_end(range) - 1)))
+    {
+      t_task = range_end(range) - 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Thread_Pool::execute(int t_task)
+{
+  try {
+    (*m_task)(t_task);
+  } catch (...) {
+    std::unique_lock<std::mutex> l(m_mutex);
+    if (!m_exception)
+    {
+      m_exception = std::current_exception();
+    }
+  }
+}
+
+void Thread_Pool::run_tasks(int t_slot)
+{
+  int task;
+
+  while (take_front(t_slot, task))
+  {
+    execute(task);
+  }
+
+  // own slice is done, help the others starting with the next thread over
+  const int slots = num_threads();
+  for (int i = 1; i < slots; ++i)
+  {
+    const int victim = (t_slot + i) % slots;
+
+    while (take_back(victim, task))
+    {
+      execute(task);
+    }
+  }
+}
+
+void Thread_Pool::work(int t_slot)
+{
+  unsigned generation = 0;
+
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> l(m_mutex);
+      while (!m_stop && m_generation == generation)
+      {
+        m_start.wait(l);
+      }
+
+      if (m_stop)
+      {
+        return;
+      }
+
+      generation = m_generation;
+    }
+
+    run_tasks(t_slot);
+
+    std::unique_lock<std::mutex> l(m_mutex);
+    if (--m_active_workers == 0)
+    {
+      m_done.notify_one();
+    }
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef WORLDBUILDER_THREAD_POOL_HPP
+#define WORLDBUILDER_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of worker threads that cooperatively work through batches of
+/// indexed tasks. The thread calling run() takes part in the batch, so a pool
+/// of one thread runs everything inline without spawning anything.
+///
+/// Each batch is split into one contiguous slice of task indices per thread.
+/// A thread works through its own slice front to back, so neighbouring tasks
+/// stay on the same thread, and once it runs dry steals tasks from the back
+/// of the other slices.
+class Thread_Pool
+{
+  public:
+    /// \param t_num_threads total number of threads working on a batch, values
+    ///        below 1 are treated as 1
+    explicit Thread_Pool(int t_num_threads);
+    ~Thread_Pool();
+
+    Thread_Pool(const Thread_Pool &) = delete;
+    Thread_Pool &operator=(const Thread_Pool &) = delete;
+
+    int num_threads() const;
+
+    /// Calls t_task(i) for every i in [0, t_num_tasks) and returns once all of
+    /// them have completed. Tasks may run concurrently and in any order. The
+    /// first exception thrown by a task is rethrown here after the batch has
+    /// drained.
+    void run(int t_num_tasks, const std::function<void (int)> &t_task);
+
+  private:
+    /// Remaining task indices [begin, end) of one thread's slice, packed into
+    /// a single word so the owner and thieves can both claim tasks with one
+    /// compare and swap. Padded to keep slices off each other's cache lines.
+    struct Task_Slice
+    {
+      std::atomic<std::uint64_t> range;
+      char padding[64 - sizeof(std::atomic<std::uint64_t>)];
+    };
+
+    void work(int t_slot);
+    void run_tasks(int t_slot);
+    bool take_front(int t_slot, int &t_task);
+    bool take_back(int t_slot, int &t_task);
+    void execute(int t_task);
+
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+
+    const std::function<void (int)> *m_task;
+    std::unique_ptr<Task_Slice[]> m_slices;
+    int m_active_workers;
+    unsigned m_generation;
+    bool m_stop;
+    std::exception_ptr m_exception;
+};
+
+#endif
@@ -1,9 +1,230 @@
 #include <chrono>
 #include "World.hpp"
-#include <iostream>
+#include "Map_File.hpp"
+#include "Profiler.hpp"
+#include "Thread_Pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+
+namespace
+{
+  const double water_spread_rate = 0.5;    //< swamp tiles flooded per second per neighbouring water tile
+  const double forest_growth_rate = 0.05;  //< plain tiles overgrown per second per neighbouring forest tile
+  const double erosion_rate = 0.002;       //< mountain tiles eroded per second per exposed side, water counts twice
+
+  /// Uniformly distributed bits that only depend on the tick and the tile,
+  /// so bands can be simulated in any order on any thread
+  std::uint32_t tile_noise(std::uint64_t t_tick, std::uint64_t t_tile)
+  {
+    return std::uint32_t(mix64(t_tick * 0x9E3779B97F4A7C15ULL + t_tile) >> 32);
+  }
+
+  /// Chance per tick of a change happening, as a threshold for tile_noise(),
+  /// given t_rate expected changes per second per neighbour and the number of
+  /// neighbours driving it
+  std::uint64_t change_threshold(double t_rate, int t_neighbours, double t_frame_ms)
+  {
+    const double p = 1 - std::exp(-t_rate * t_neighbours * t_frame_ms / 1000);
+    return std::uint64_t(p * 4294967296.0);
+  }
+
+  struct Automaton_Rules
+  {
+    Automaton_Rules()
+      : weights(), thresholds()
+    {
+      for (int i = 0; i < 16; ++i)
+      {
+        results[i] = std::uint8_t(i);
+      }
+    }
+
+    enum { off_map = 0x0F }; //< terrain nibble standing in for neighbours off the map
+
+    std::uint8_t weights[16][16];     //< how much each neighbouring terrain drives a terrain to change, never itself
+    std::uint64_t thresholds[16][9];  //< tile_noise() threshold for a change, by terrain and summed weight
+    std::uint8_t results[16];         //< what each terrain changes into
+  };
+
+  /// Next tick of tile t_x of a row, t_left and t_right being the terrain
+  /// of its neighbours in the row
+  inline std::uint8_t update_tile(const Automaton_Rules &t_rules, std::uint64_t t_tick, size_t t_tile,
+      const std::uint8_t *t_above, const std::uint8_t *t_row, const std::uint8_t *t_below, int t_x, int t_left, int t_right)
+  {
+    const int terrain = t_row[t_x] & 0x0F;
+    const std::uint8_t *weight = t_rules.weights[terrain];
+    const int count = weight[t_above[t_x] & 0x0F] + weight[t_below[t_x] & 0x0F] + weight[t_left] + weight[t_right];
+    const std::uint64_t threshold = t_rules.thresholds[terrain][count];
+
+    // Tiles away from terrain borders have nothing driving a change, skip
+    // the noise for them. Past that, no branch depends on the random outcome.
+    if (threshold == 0)
+    {
+      return t_row[t_x];
+    }
+
+    const bool change = tile_noise(t_tick, t_tile) < threshold;
+    return change ? std::uint8_t((t_row[t_x] & 0xF0) | t_rules.results[terrain]) : t_row[t_x];
+  }
+
+  std::uint64_t load_word(const std::uint8_t *t_p)
+  {
+    std::uint64_t word;
+    std::memcpy(&word, t_p, sizeof(word));
+    return word;
+  }
+
+  /// Computes the next tick of one row of t_width tiles, t_first_tile being
+  /// the index of its first tile in the map.
+  void update_row(const Automaton_Rules &t_rules, std::uint64_t t_tick, size_t t_first_tile, int t_width,
+      const std::uint8_t *t_above, const std::uint8_t *t_row, const std::uint8_t *t_below, std::uint8_t *t_out)
+  {
+    const std::uint64_t terrain_mask = 0x0F0F0F0F0F0F0F0FULL;
+
+    int x = 0;
+    while (x < t_width)
+    {
+      // Eight tiles at once: if every one of them is surrounded by its own
+      // terrain nothing can change, as no terrain drives itself to change.
+      // Most of a map is the inside of some terrain.
+      if (x > 0 && x + 9 <= t_width)
+      {
+        const std::uint64_t terrain = load_word(t_row + x) & terrain_mask;
+
+        if (terrain == (load_word(t_row + x - 1) & terrain_mask) && terrain == (load_word(t_row + x + 1) & terrain_mask)
+            && terrain == (load_word(t_above + x) & terrain_mask) && terrain == (load_word(t_below + x) & terrain_mask))
+        {
+          std::memcpy(t_out + x, t_row + x, 8);
+          x += 8;
+          continue;
+        }
+      }
+
+      t_out[x] = update_tile(t_rules, t_tick, t_first_tile + x, t_above, t_row, t_below, x,
+          x > 0 ? t_row[x - 1] & 0x0F : Automaton_Rules::off_map,
+          x + 1 < t_width ? t_row[x + 1] & 0x0F : Automaton_Rules::off_map);
+      ++x;
+    }
+  }
+}
 
-void Simulation::simulate(const Simulation_Status &t_new_status)
+void Simulation::simulate(const Simulation_Status &t_new_status, Thread_Pool &t_pool, Map_Instance &t_back_buffer)
 {
+  Scoped_Timer timer("Simulation::simulate");
+
+  status = t_new_status;
+
+  const int width = map.num_horizontal();
+  const int height = map.num_vertical();
+
+  // Dense maps are computed straight into a dense back buffer. Chunked and
+  // externally owned maps are never flattened: the back buffer starts out as
+  // a copy sharing all chunks, and only the rows that change are written,
+  // copying just the chunks they touch.
+  const bool in_place = height > 0 && map.writable_row(0);
+
+  if (!in_place)
+  {
+    t_back_buffer = map;
+  } else if (t_back_buffer.num_horizontal() != width || t_back_buffer.num_vertical() != height || !t_back_buffer.writable_row(0)) {
+    t_back_buffer = Map_Instance(map.tile_width(), map.tile_height(), width, height);
+  }
+
+  Automaton_Rules rules;
+
+  rules.weights[Swamp][Water] = 1;
+  rules.weights[Plain][Forest] = 1;
+  rules.weights[Mountain][Plain] = rules.weights[Mountain][Swamp] = rules.weights[Mountain][Forest] = 1;
+  rules.weights[Mountain][Water] = 2;
+
+  rules.results[Swamp] = Water;
+  rules.results[Plain] = Forest;
+  rules.results[Mountain] = Plain;
+
+  for (int count = 0; count < 9; ++count)
+  {
+    rules.thresholds[Swamp][count] = change_threshold(water_spread_rate, count, status.frame_ms);
+    rules.thresholds[Plain][count] = change_threshold(forest_growth_rate, count, status.frame_ms);
+    rules.thresholds[Mountain][count] = change_threshold(erosion_rate, count, status.frame_ms);
+  }
+
+  const std::vector<std::uint8_t> off_map(width, std::uint8_t(Automaton_Rules::off_map));
+  const std::uint64_t tick = std::uint64_t(std::llround(status.total_ms * 1000));
+
+  const int num_bands = std::min(height, t_pool.num_threads() * 8);
+
+  // guards t_back_buffer while it is not written in place
+  std::mutex write_mutex;
+
+  t_pool.run(num_bands,
+      [&](int t_band)
+      {
+        const int first_y = height * t_band / num_bands;
+
+        // three input rows used round robin, then the output row
+        std::vector<std::uint8_t> buffer(size_t(width) * 4);
+        std::uint8_t *out_buffer = &buffer[size_t(width) * 3];
+
+        const auto read_row = [&](int y) -> const std::uint8_t *
+        {
+          if (y < 0 || y >= height)
+          {
+            return off_map.data();
+          }
+
+          if (const std::uint8_t *row = map.dense_row(y))
+          {
+            return row;
+          }
+
+          std::uint8_t *row = &buffer[size_t((y + 3) % 3) * width];
+          map.read_row(0, y, width, row);
+          return row;
+        };
+
+        const std::uint8_t *above = read_row(first_y - 1);
+        const std::uint8_t *row = read_row(first_y);
+
+        for (int y = first_y; y < height * (t_band + 1) / num_bands; ++y)
+        {
+          const std::uint8_t *below = read_row(y + 1);
+
+          if (in_place)
+          {
+            update_row(rules, tick, size_t(y) * width, width, above, row, below, t_back_buffer.writable_row(y));
+          } else {
+            update_row(rules, tick, size_t(y) * width, width, above, row, below, out_buffer);
+
+            int first_changed = 0;
+            while (first_changed < width && out_buffer[first_changed] == row[first_changed])
+            {
+              ++first_changed;
+            }
+
+            if (first_changed < width)
+            {
+              int end_changed = width;
+              while (out_buffer[end_changed - 1] == row[end_changed - 1])
+              {
+                --end_changed;
+              }
+
+              std::unique_lock<std::mutex> l(write_mutex);
+              t_back_buffer.write_row(first_changed, y, end_changed - first_changed, out_buffer + first_changed);
+            }
+          }
+
+          above = row;
+          row = below;
+        }
+      }
+    );
+
+  std::swap(map, t_back_buffer);
 }
 
 Simulation::Simulation(const Simulation_Status &t_status, const Map_Instance &t_map)
@@ -12,39 +233,64 @@ Simulation::Simulation(const Simulation_Status &t_status, const Map_Instance &t_
 }
 
 
-World_Instance::World_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, std::mt19937 &t_engine,
-        const Map &t_map)
+World_Instance::World_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, const Random_Stream &t_random,
+        const Map &t_map, const Render_Options &t_options)
   : m_tile_width(t_tile_width), m_tile_height(t_tile_height), m_num_horizontal(t_num_horizontal), m_num_vertical(t_num_vertical),
-    m_simulation(Simulation_Status(), t_map.render(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, t_engine)),
-    m_current_simulation(m_simulation)
+    m_simulation(Simulation_Status(), t_map.render(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, t_random, t_options)),
+    m_current_simulation(std::make_shared<Simulation>(m_simulation)),
+    m_cont_simulation(false),
+    m_scheduler(1.0, 10)
 {
 };
 
-Simulation World_Instance::get_current_simulation() const
+World_Instance::World_Instance(const Map_Instance &t_map)
+  : m_tile_width(t_map.tile_width()), m_tile_height(t_map.tile_height()), m_num_horizontal(t_map.num_horizontal()), m_num_vertical(t_map.num_vertical()),
+    m_simulation(Simulation_Status(), t_map),
+    m_current_simulation(std::make_shared<Simulation>(m_simulation)),
+    m_cont_simulation(false),
+    m_scheduler(1.0, 10)
+{
+}
+
+World_Instance::~World_Instance()
 {
-  std::unique_lock<std::mutex> l(m_mutex);
-  return m_current_simulation;
+  stop();
+}
+
+std::shared_ptr<const Simulation> World_Instance::get_current_simulation() const
+{
+  return std::atomic_load(&m_current_simulation);
 }
 
 void World_Instance::set_current_simulation(const Simulation &t_simulation) 
 {
-  std::unique_lock<std::mutex> l(m_mutex);
-  m_current_simulation = t_simulation;
+  Scoped_Timer timer("World_Instance::publish");
+
+  std::shared_ptr<Simulation> next;
+
+  if (m_spare_simulation && m_spare_simulation.unique())
+  {
+    // The spare was retired by the previous publish, so no reader can pick it up
+    // anymore and the last one has let go of it. Reuse its tile storage.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    next = m_spare_simulation;
+    *next = t_simulation;
+  } else {
+    next = std::make_shared<Simulation>(t_simulation);
+  }
+
+  std::shared_ptr<const Simulation> previous = std::atomic_exchange(&m_current_simulation, std::shared_ptr<const Simulation>(next));
+  m_spare_simulation = std::const_pointer_cast<Simulation>(previous);
 }
 
 void World_Instance::set_new_status(const Simulation_Status &t_status)
 {
-  std::unique_lock<std::mutex> l(m_mutex);
-
-  m_status = std::shared_ptr<Simulation_Status>(new Simulation_Status(t_status));
+  std::atomic_store(&m_status, std::make_shared<Simulation_Status>(t_status));
 }
 
 Simulation_Status World_Instance::get_new_status(const Simulation_Status &t_status)
 {
-  std::unique_lock<std::mutex> l(m_mutex);
-
-  std::shared_ptr<Simulation_Status> s = m_status;
-  m_status.reset();
+  std::shared_ptr<Simulation_Status> s = std::atomic_exchange(&m_status, std::shared_ptr<Simulation_Status>());
 
   if (s) 
   {
@@ -59,50 +305,157 @@ Simulation_Status World_Instance::get_new_status(const Simulation_Status &t_stat
 void World_Instance::start()
 {
   m_cont_simulation = true;
+  m_scheduler.start();
   m_thread = std::thread(std::bind(&World_Instance::simulate, this));
 }
 
+void World_Instance::stop()
+{
+  m_cont_simulation = false;
+  m_scheduler.stop();
 
-void World_Instance::simulate()
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+}
+
+void World_Instance::set_schedule_mode(Schedule_Mode t_mode)
 {
-  typedef std::conditional<std::chrono::high_resolution_clock::is_monotonic, std::chrono::high_resolution_clock, std::chrono::monotonic_clock>::type clocktype;
+  m_scheduler.set_mode(t_mode);
+}
 
-  clocktype::time_point starttime = clocktype::now();
-  clocktype::time_point t1 = starttime;
+Schedule_Mode World_Instance::schedule_mode() const
+{
+  return m_scheduler.mode();
+}
+
+void World_Instance::step()
+{
+  m_scheduler.step();
+}
 
-  int frame = 0;
+Scheduler_Stats World_Instance::scheduler_stats() const
+{
+  return m_scheduler.stats();
+}
+
+World_Instance::Map_Edit::Map_Edit(const Dirty_Rect &t_rect)
+  : rect(t_rect), tiles(size_t(std::max(0, t_rect.width)) * std::max(0, t_rect.height))
+{
+}
+
+void World_Instance::apply_edits(const Map_Instance &t_source, const std::vector<Dirty_Rect> &t_rects)
+{
+  if (t_source.num_horizontal() != m_num_horizontal || t_source.num_vertical() != m_num_vertical)
+  {
+    throw std::range_error("Edited map does not match the world size");
+  }
+
+  std::vector<Map_Edit> edits;
+
+  for (const Dirty_Rect &rect: t_rects)
+  {
+    if (rect.x < 0 || rect.y < 0 || rect.width < 0 || rect.height < 0
+        || rect.x + rect.width > m_num_horizontal || rect.y + rect.height > m_num_vertical)
+    {
+      throw std::range_error("Outside of map range");
+    }
+
+    edits.push_back(Map_Edit(rect));
+    for (int y = 0; y < rect.height; ++y)
+    {
+      t_source.read_row(rect.x, rect.y + y, rect.width, edits.back().tiles.data() + size_t(y) * rect.width);
+    }
+  }
 
-  while (m_cont_simulation)
   {
-    ++frame;
+    std::unique_lock<std::mutex> l(m_edits_mutex);
+    m_edits.insert(m_edits.end(), edits.begin(), edits.end());
+  }
+
+  if (m_thread.joinable())
+  {
+    m_scheduler.wake();
+  } else if (take_edits()) {
+    set_current_simulation(m_simulation);
+  }
+}
+
+bool World_Instance::take_edits()
+{
+  std::vector<Map_Edit> edits;
+
+  {
+    std::unique_lock<std::mutex> l(m_edits_mutex);
+    edits.swap(m_edits);
+  }
+
+  for (const Map_Edit &edit: edits)
+  {
+    for (int y = 0; y < edit.rect.height; ++y)
+    {
+      m_simulation.map.write_row(edit.rect.x, edit.rect.y + y, edit.rect.width, edit.tiles.data() + size_t(y) * edit.rect.width);
+    }
+  }
+
+  return !edits.empty();
+}
+
+
+void World_Instance::simulate()
+{
+  typedef std::chrono::steady_clock clocktype;
 
-    clocktype::time_point t2 = clocktype::now();
-    clocktype::duration frame_duration = t2 - t1;
-    clocktype::duration total_duration = t2 - starttime;
+  Profiler::set_thread_name("simulation");
 
-    t1 = t2;
+  // every tick advances the simulation by the same amount, however late it runs
+  const double tick_ms = m_scheduler.tick_ms();
+  long ticks = 0;
 
-    double frame_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(frame_duration).count();
-    double total_ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(total_duration).count();
+  clocktype::time_point last_publish = clocktype::now();
+  bool unpublished = false;
 
-    Simulation &sim = m_simulation;
-    Simulation_Status status = get_new_status(sim.status);
-    status.frame_ms = frame_ms;
-    status.total_ms = total_ms;
-    sim.simulate(status);
+  Thread_Pool pool(std::max(1, int(std::thread::hardware_concurrency())));
+  // sized and laid out to match the map by its first tick
+  Map_Instance back_buffer(m_tile_width, m_tile_height, 0, 0);
 
-    set_current_simulation(sim);
+  while (m_cont_simulation)
+  {
+    const int num_ticks = m_scheduler.next_ticks();
 
-    if (frame_ms < 1)
+    if (take_edits())
     {
-      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(1-frame_ms));
+      unpublished = true;
+    }
+
+    for (int i = 0; i < num_ticks; ++i)
+    {
+      ++ticks;
+
+      Simulation &sim = m_simulation;
+      Simulation_Status status = get_new_status(sim.status);
+      status.frame_ms = tick_ms;
+      status.total_ms = ticks * tick_ms;
+
+      clocktype::time_point t1 = clocktype::now();
+      sim.simulate(status, pool, back_buffer);
+      m_scheduler.tick_done(std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(clocktype::now() - t1).count());
+      unpublished = true;
     }
 
-    if (frame % 1000 == 0)
+    // Publishing copies the whole simulation, so catch up ticks are published
+    // once and fast forward no more often than real time ticks would be.
+    clocktype::time_point now = clocktype::now();
+    if (unpublished
+        && (m_scheduler.mode() != Fast_Forward || now - last_publish >= std::chrono::duration<double, std::milli>(tick_ms)))
     {
-      std::cout << "Simulation FPS: " << (1 / frame_ms) * 1000 << std::endl;
+      set_current_simulation(m_simulation);
+      last_publish = now;
+      unpublished = false;
     }
 
+    m_scheduler.update_stats(1000);
   }
 }
 
@@ -116,14 +469,85 @@ void World::add_map(const Map &t_map)
   m_maps.push_back(t_map);
 }
 
+const std::vector<Map> &World::maps() const
+{
+  return m_maps;
+}
+
 std::shared_ptr<World_Instance> World::render(int t_tile_width, int t_tile_height, 
-    int t_num_horizontal, int t_num_vertical, int t_seed) const
+    int t_num_horizontal, int t_num_vertical, int t_seed, const Render_Options &t_options) const
 {
-  std::mt19937 engine(t_seed);
-  std::shared_ptr<World_Instance> wi(new World_Instance(t_tile_width, t_tile_height, 
-        t_num_horizontal, t_num_vertical, engine, m_maps.at(0)));
+  return std::make_shared<World_Instance>(render_map(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, t_seed, t_options));
+}
 
-  return wi;
+Map_Instance World::render_map(int t_tile_width, int t_tile_height,
+    int t_num_horizontal, int t_num_vertical, int t_seed, const Render_Options &t_options) const
+{
+  if (m_maps.size() <= 1)
+  {
+    return m_maps.at(0).render(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical,
+        Random_Stream(t_seed).split(Map_Random, 0), t_options);
+  }
+
+  // Lay the maps out in rows of up to ceil(sqrt(n)) maps, splitting each row
+  // evenly between the maps on it so the last, shorter row leaves no gap.
+  const int num_maps = int(m_maps.size());
+  const int num_columns = int(std::ceil(std::sqrt(double(num_maps))));
+  const int num_rows = (num_maps + num_columns - 1) / num_columns;
+
+  Map_Instance instance(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical);
+
+  // t_options.num_threads is split between the maps and the bands of each
+  // map, so nesting does not multiply the threads
+  Thread_Pool pool(std::min(num_maps, std::max(1, t_options.num_threads)));
+
+  Render_Options map_options = t_options;
+  map_options.num_threads = std::max(1, t_options.num_threads / pool.num_threads());
+
+  pool.run(num_maps,
+      [&](int t_map)
+      {
+        const int row = t_map / num_columns;
+        const int column = t_map % num_columns;
+        const int maps_on_row = std::min(num_columns, num_maps - row * num_columns);
+
+        const int first_x = t_num_horizontal * column / maps_on_row;
+        const int end_x = t_num_horizontal * (column + 1) / maps_on_row;
+        const int first_y = t_num_vertical * row / num_rows;
+        const int end_y = t_num_vertical * (row + 1) / num_rows;
+
+        if (end_x == first_x || end_y == first_y)
+        {
+          return;
+        }
+
+        m_maps[t_map].render_into(instance, first_x, first_y, end_x - first_x, end_y - first_y,
+            Random_Stream(t_seed).split(Map_Random, t_map), map_options);
+      }
+    );
+
+  return instance;
 }
 
 
+
+std::shared_ptr<World_Instance> World::render_cached(const std::string &t_filename, std::uint64_t t_source_hash,
+    int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, int t_seed, const Render_Options &t_options) const
+{
+  try {
+    const Map_File::Header header = Map_File::read_header(t_filename);
+
+    if (header.source_hash == t_source_hash && header.seed == std::uint64_t(t_seed)
+        && header.tile_width == t_tile_width && header.tile_height == t_tile_height
+        && header.num_horizontal == t_num_horizontal && header.num_vertical == t_num_vertical)
+    {
+      return std::make_shared<World_Instance>(Map_File::load(t_filename));
+    }
+  } catch (const std::exception &) {
+    // missing, outdated or damaged map file, render it again below
+  }
+
+  std::shared_ptr<World_Instance> wi = render(t_tile_width, t_tile_height, t_num_horizontal, t_num_vertical, t_seed, t_options);
+  Map_File::save(t_filename, wi->get_current_simulation()->map, t_seed, t_source_hash);
+  return wi;
+}
@@ -4,9 +4,16 @@
 #include <random>
 #include <atomic>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <string>
+#include <cstdint>
+#include <vector>
 
 #include "Map.hpp"
+#include "Simulation_Scheduler.hpp"
+
+class Thread_Pool;
 
 class Simulation_Status
 {
@@ -23,20 +30,54 @@ class Simulation
 
     Simulation(const Simulation_Status &t_status, const Map_Instance &t_map);
 
-    void simulate(const Simulation_Status &t_new_status);
+    /// Advances the terrain by one tick of t_new_status.frame_ms as a cellular
+    /// automaton: water floods neighbouring swamp, forest spreads onto
+    /// neighbouring plains and exposed mountains erode into plains. Every
+    /// tile is computed from the previous tick only, band by band on t_pool,
+    /// into t_back_buffer, which is then swapped with map. Passing the same
+    /// buffer every tick saves reallocating it. Chunked and externally owned
+    /// maps are read row by row and stay chunked, only the chunks holding
+    /// changed tiles are copied. The result does not depend on the number of
+    /// threads or on how the map is stored.
+    void simulate(const Simulation_Status &t_new_status, Thread_Pool &t_pool, Map_Instance &t_back_buffer);
 };
 
 class World_Instance
 {
   public:
-    World_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, std::mt19937 &t_engine,
-        const Map &t_map);
-    Simulation get_current_simulation() const;
+    World_Instance(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, const Random_Stream &t_random,
+        const Map &t_map, const Render_Options &t_options);
+    explicit World_Instance(const Map_Instance &t_map);
+    ~World_Instance();
+    /// Returns the most recently published snapshot. Readers never wait for a
+    /// simulation step, only for the short internal lock the shared_ptr
+    /// atomics take. The snapshot is immutable and stays valid for as long
+    /// as the caller holds on to it.
+    std::shared_ptr<const Simulation> get_current_simulation() const;
     World_Instance(const World_Instance &) = delete;
     World_Instance &operator=(const World_Instance &) = delete;
     void start();
+    /// Stops and joins the simulation thread, also done on destruction
+    void stop();
     void set_new_status(const Simulation_Status &t_status);
 
+    void set_schedule_mode(Schedule_Mode t_mode);
+    Schedule_Mode schedule_mode() const;
+    /// Runs a single tick while paused
+    void step();
+    /// Achieved tick rate and tick latencies over the last second
+    Scheduler_Stats scheduler_stats() const;
+
+    /// Copies the tiles under t_rects from t_source, usually the rectangles a
+    /// Map_Editor returned and its instance(), into the simulated map. While
+    /// the simulation thread runs they are applied before its next tick, even
+    /// if paused, otherwise right away. Either way the next published snapshot
+    /// has them. Call from the thread that starts and stops the world.
+    ///
+    /// Throws std::range_error if t_source is not the size of the world or a
+    /// rectangle is not on it.
+    void apply_edits(const Map_Instance &t_source, const std::vector<Dirty_Rect> &t_rects);
+
   private:
     int m_tile_width;
     int m_tile_height;
@@ -46,13 +87,29 @@ class World_Instance
     void set_current_simulation(const Simulation &t_simulation);
     Simulation_Status get_new_status(const Simulation_Status &t_status);
 
+    /// Tiles of an edit, row by row, packed with Map_Instance::pack()
+    struct Map_Edit
+    {
+      Map_Edit(const Dirty_Rect &t_rect);
+
+      Dirty_Rect rect;
+      std::vector<std::uint8_t> tiles;
+    };
+
+    /// Writes the queued edits into m_simulation, returns whether there were any
+    bool take_edits();
+
     Simulation m_simulation;
-    Simulation m_current_simulation; //< \todo make this an std::atomic<> when the compiler allows for it
-    std::shared_ptr<Simulation_Status> m_status; //< \todo make this an std::atomic<> when the compiler allows for it
+    std::shared_ptr<const Simulation> m_current_simulation; //< only accessed with std::atomic_load / std::atomic_exchange
+    std::shared_ptr<Simulation> m_spare_simulation; //< retired snapshot, reused by the simulation thread once no reader holds it
+    std::shared_ptr<Simulation_Status> m_status; //< only accessed with std::atomic_store / std::atomic_exchange
     std::atomic_bool m_cont_simulation;
+    Simulation_Scheduler m_scheduler;
+
+    std::mutex m_edits_mutex;
+    std::vector<Map_Edit> m_edits; //< queued by apply_edits(), guarded by m_edits_mutex
 
     std::thread m_thread;
-    mutable std::mutex m_mutex;
     void simulate();
 };
 
@@ -60,8 +117,32 @@ class World
 {
   public:
     World();
-    std::shared_ptr<World_Instance> render(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, int t_seed) const;
+
+    /// Renders all maps side by side into one world of t_num_horizontal x
+    /// t_num_vertical tiles, in rows of up to ceil(sqrt(n)) maps. Each map
+    /// renders from its own Random_Stream split off t_seed. The
+    /// t_options.num_threads threads are shared out between the maps and the
+    /// bands within each map, never more in total. With
+    /// several maps the world is always rendered densely, t_options.chunk_size
+    /// only applies to worlds of a single map.
+    std::shared_ptr<World_Instance> render(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, int t_seed,
+        const Render_Options &t_options = Render_Options()) const;
+
+    /// The map render() starts the world with, without setting up a
+    /// simulation for it
+    Map_Instance render_map(int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, int t_seed,
+        const Render_Options &t_options = Render_Options()) const;
+
     void add_map(const Map &t_map);
+    const std::vector<Map> &maps() const;
+
+    /// Like render(), but reuses the map stored in t_filename if it was saved
+    /// with the same dimensions, seed and t_source_hash, otherwise renders and
+    /// stores the map there. t_source_hash should identify everything the
+    /// world definition was built from, such as the script contents.
+    std::shared_ptr<World_Instance> render_cached(const std::string &t_filename, std::uint64_t t_source_hash,
+        int t_tile_width, int t_tile_height, int t_num_horizontal, int t_num_vertical, int t_seed,
+        const Render_Options &t_options = Render_Options()) const;
 
   private:
     std::vector<Map> m_maps;
@@ -0,0 +1,148 @@
+#include "World_File.hpp"
+#include "Hash.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+  const char magic[8] = { 'W', 'B', 'W', 'O', 'R', 'L', 'D', 0 };
+
+  void put(std::string &t_data, std::uint64_t t_value, int t_bytes)
+  {
+    for (int i = 0; i < t_bytes; ++i)
+    {
+      t_data.push_back(char(std::uint8_t(t_value >> (8 * i))));
+    }
+  }
+
+  /// Reads sequentially through a loaded world file, throwing once it runs
+  /// past the end
+  class Reader
+  {
+    public:
+      Reader(const std::string &t_data, const std::string &t_filename)
+        : m_data(t_data), m_filename(t_filename), m_offset(0)
+      {
+      }
+
+      std::uint64_t get(int t_bytes)
+      {
+        if (m_data.size() - m_offset < size_t(t_bytes))
+        {
+          throw std::runtime_error("Truncated world file: " + m_filename);
+        }
+
+        std::uint64_t value = 0;
+        for (int i = 0; i < t_bytes; ++i)
+        {
+          value |= std::uint64_t(std::uint8_t(m_data[m_offset++])) << (8 * i);
+        }
+        return value;
+      }
+
+      /// Reads one byte and checks it is a valid value of an enum ending at t_last
+      int get_enum(int t_last)
+      {
+        const int value = int(get(1));
+
+        if (value > t_last)
+        {
+          throw std::runtime_error("Damaged world file: " + m_filename);
+        }
+
+        return value;
+      }
+
+    private:
+      const std::string &m_data;
+      const std::string &m_filename;
+      size_t m_offset;
+  };
+}
+
+void World_File::save(const std::string &t_filename, const World &t_world, std::uint64_t t_source_hash)
+{
+  std::string data(magic, sizeof(magic));
+  put(data, version, 4);
+  put(data, t_world.maps().size(), 4);
+  put(data, t_source_hash, 8);
+
+  for (const auto &map: t_world.maps())
+  {
+    put(data, map.background(), 1);
+
+    put(data, map.terrains().size(), 4);
+    for (const auto &terrain: map.terrains())
+    {
+      put(data, terrain.location, 1);
+      put(data, terrain.type, 1);
+    }
+
+    put(data, map.features().size(), 4);
+    for (const auto &feature: map.features())
+    {
+      put(data, feature.location, 1);
+      put(data, feature.type, 1);
+    }
+  }
+
+  std::ofstream file(t_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  file.write(data.data(), data.size());
+
+  if (!file)
+  {
+    throw std::runtime_error("Unable to write world file: " + t_filename);
+  }
+}
+
+World World_File::load(const std::string &t_filename, std::uint64_t t_source_hash)
+{
+  const std::string data = read_file(t_filename);
+
+  if (data.size() < header_size || std::memcmp(data.data(), magic, sizeof(magic)) != 0)
+  {
+    throw std::runtime_error("Not a world file: " + t_filename);
+  }
+
+  Reader reader(data, t_filename);
+  reader.get(sizeof(magic));
+
+  if (reader.get(4) != version)
+  {
+    throw std::runtime_error("Unsupported world file version: " + t_filename);
+  }
+
+  const std::uint64_t num_maps = reader.get(4);
+
+  if (reader.get(8) != t_source_hash)
+  {
+    throw std::runtime_error("Outdated world file: " + t_filename);
+  }
+
+  World world;
+
+  for (std::uint64_t i = 0; i < num_maps; ++i)
+  {
+    Map map(Terrain_Type(reader.get_enum(Forest)));
+
+    const std::uint64_t num_terrains = reader.get(4);
+    for (std::uint64_t t = 0; t < num_terrains; ++t)
+    {
+      const Location location = Location(reader.get_enum(SouthWest));
+      map.add_terrain(Map_Terrain(location, Terrain_Type(reader.get_enum(Forest))));
+    }
+
+    const std::uint64_t num_features = reader.get(4);
+    for (std::uint64_t f = 0; f < num_features; ++f)
+    {
+      const Location location = Location(reader.get_enum(SouthWest));
+      map.add_map_feature(Map_Feature(location, Feature_Type(reader.get_enum(Town))));
+    }
+
+    world.add_map(map);
+  }
+
+  return world;
+}
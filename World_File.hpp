@@ -0,0 +1,41 @@
+#ifndef WORLDBUILDER_WORLD_FILE_HPP
+#define WORLDBUILDER_WORLD_FILE_HPP
+
+#include "World.hpp"
+
+#include <cstdint>
+#include <string>
+
+/// Versioned binary file holding an evaluated World definition, so starting
+/// up with an unchanged script needs neither the ChaiScript engine nor the
+/// script.
+///
+///   offset  size  field
+///        0     8  magic "WBWORLD\0"
+///        8     4  format version
+///       12     4  number of maps
+///       16     8  source hash, identifies what the world was built from
+///       24        the maps, one after the other:
+///                    1  background Terrain_Type
+///                    4  number of terrains, followed by 2 bytes for each:
+///                       Location, Terrain_Type
+///                    4  number of features, followed by 2 bytes for each:
+///                       Location, Feature_Type
+///
+/// Fields are stored little endian.
+class World_File
+{
+  public:
+    static const std::uint32_t version = 1;
+
+    static void save(const std::string &t_filename, const World &t_world, std::uint64_t t_source_hash);
+
+    /// Throws std::runtime_error if the file cannot be read, is not a world
+    /// file of the current version or was not saved with t_source_hash.
+    static World load(const std::string &t_filename, std::uint64_t t_source_hash);
+
+  private:
+    static const size_t header_size = 24;
+};
+
+#endif
@@ -1,18 +1,252 @@
 #include "SDL.hpp"
 
 #include "ChaiScript_Builder.hpp"
+#include "Hash.hpp"
+#include "Map_File.hpp"
+#include "Profiler.hpp"
+#include "Seed_Sweep.hpp"
+#include "World_File.hpp"
 
-int main(int , char *argv[])
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+
+namespace
 {
-  World world;
+  const int screen_width = 640;
+  const int screen_height = 480;
+  const int tile_width = 16;
+  const int tile_height = 16;
 
-  std::shared_ptr<chaiscript::ChaiScript> chai = ChaiScript_Builder::build();
-  chai->add(chaiscript::var(std::ref(world)), "world");
-  chai->eval_file(argv[1]);
+  // default world size, one screen
+  const int num_horizontal = screen_width / tile_width;
+  const int num_vertical = screen_height / tile_height;
 
-  SDL_Engine e(world);
-  e.run(); 
+  void usage()
+  {
+    std::cerr << "usage: worldbuilder [options] <script> [map file]\n"
+              << "       worldbuilder --batch [options] <script> <first seed> <number of seeds> [threads]\n"
+              << "options:\n"
+              << "  --size <tiles across> <tiles down>  world size, one screen by default\n"
+              << "  --cache                             reuse the evaluated script from <script>.world" << std::endl;
+  }
+
+  /// Parses all of t_text as an integer of at least t_min into t_value,
+  /// returns false if it is not one
+  bool parse_int(const char *t_text, int t_min, int &t_value)
+  {
+    size_t end = 0;
+
+    try {
+      t_value = std::stoi(t_text, &end);
+    } catch (const std::exception &) {
+      return false;
+    }
+
+    return t_text[end] == '\0' && t_value >= t_min;
+  }
+
+  /// Consumes the options starting at t_arg, leaving t_arg at the first
+  /// argument after them. Returns false on an unknown or malformed option.
+  bool parse_options(int argc, char *argv[], int &t_arg, int &t_num_horizontal, int &t_num_vertical, bool &t_cache)
+  {
+    while (t_arg < argc && std::strncmp(argv[t_arg], "--", 2) == 0)
+    {
+      if (std::strcmp(argv[t_arg], "--size") == 0)
+      {
+        if (t_arg + 2 >= argc || !parse_int(argv[t_arg + 1], 1, t_num_horizontal) || !parse_int(argv[t_arg + 2], 1, t_num_vertical))
+        {
+          return false;
+        }
+
+        t_arg += 3;
+      } else if (std::strcmp(argv[t_arg], "--cache") == 0) {
+        t_cache = true;
+        ++t_arg;
+      } else {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /// The world t_filename defines. With t_cache, the evaluated definition is
+  /// stored in t_filename + ".world" and used instead of the script for as
+  /// long as neither the script nor the generator change, without ever
+  /// building a ChaiScript engine. Scripts that read other files or are not
+  /// deterministic should not be cached this way.
+  World load_world(const std::string &t_filename, std::uint64_t t_source_hash, bool t_cache)
+  {
+    const std::string cache_filename = t_filename + ".world";
+
+    // Scripts can render maps and branch on the result, so the same script
+    // may define another world once the generator renders differently.
+    // Map_File::version is bumped whenever that happens.
+    const std::uint64_t cache_key = fnv1a_hash("generator " + std::to_string(Map_File::version), t_source_hash);
+
+    if (t_cache)
+    {
+      try {
+        return World_File::load(cache_filename, cache_key);
+      } catch (const std::exception &) {
+        // missing or outdated, evaluate the script below
+      }
+    }
+
+    World world;
+
+    std::shared_ptr<chaiscript::ChaiScript> chai = ChaiScript_Builder::build();
+    chai->add(chaiscript::var(std::ref(world)), "world");
+    chai->eval_file(t_filename);
+
+    if (t_cache)
+    {
+      try {
+        World_File::save(cache_filename, world, cache_key);
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+
+    return world;
+  }
+
+  /// With WORLDBUILDER_TRACE set in the environment, prints the phase
+  /// latencies to stderr and writes a Chrome trace to the file it names
+  void write_trace()
+  {
+    const char *filename = std::getenv("WORLDBUILDER_TRACE");
+
+    if (filename && *filename)
+    {
+      Profiler::write_histograms(std::cerr);
+
+      try {
+        Profiler::write_chrome_trace(filename);
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  /// Renders every seed in the range without opening a window and prints one
+  /// line of comma separated tile counts per seed to stdout, in seed order
+  int run_batch(int argc, char *argv[])
+  {
+    int world_horizontal = num_horizontal;
+    int world_vertical = num_vertical;
+    bool cache = false;
+    int arg = 2;
+
+    if (!parse_options(argc, argv, arg, world_horizontal, world_vertical, cache))
+    {
+      usage();
+      return 1;
+    }
+
+    int first_seed = 0;
+    int num_seeds = 0;
+    int num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+    if (argc < arg + 3 || argc > arg + 4
+        || !parse_int(argv[arg + 1], std::numeric_limits<int>::min(), first_seed)
+        || !parse_int(argv[arg + 2], 0, num_seeds)
+        || (argc > arg + 3 && !parse_int(argv[arg + 3], 1, num_threads))
+        || (num_seeds > 0 && first_seed > std::numeric_limits<int>::max() - (num_seeds - 1)))
+    {
+      usage();
+      return 1;
+    }
+
+    const World world = load_world(argv[arg], fnv1a_hash(read_file(argv[arg])), cache);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    const std::vector<World_Summary> summaries = sweep_seeds(world, first_seed, num_seeds, num_threads,
+        tile_width, tile_height, world_horizontal, world_vertical);
+
+    const double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "seed,mountain,plain,water,swamp,forest,caves,towns\n";
+    for (const auto &summary: summaries)
+    {
+      std::cout << summary.seed;
+      for (size_t count: summary.terrain_counts)
+      {
+        std::cout << ',' << count;
+      }
+      std::cout << ',' << summary.feature_counts[Cave] << ',' << summary.feature_counts[Town] << '\n';
+    }
+    std::cout.flush();
+
+    std::cerr << num_seeds << " worlds in " << seconds << " s on " << num_threads << " threads, "
+              << num_seeds / seconds << " worlds/s" << std::endl;
+
+    write_trace();
+
+    return 0;
+  }
 }
 
+/// worldbuilder [--size <tiles across> <tiles down>] [--cache] <script> [map file]
+///
+/// With --cache, the evaluated script is cached next to it, see
+/// load_world(). With a map
+/// file, the rendered map is stored there and reused on the next start as
+/// long as the script and the render parameters are unchanged. Worlds larger
+/// than the screen are viewed through a camera, see SDL_Engine.
+///
+/// worldbuilder --batch [--size <tiles across> <tiles down>] [--cache] <script> <first seed> <number of seeds> [threads]
+///
+/// Evaluates the script once and summarizes the world of every seed in the
+/// range, see run_batch(). Worlds are one screen in size unless --size says
+/// otherwise.
+///
+/// Either way, setting WORLDBUILDER_TRACE=<file> dumps the recorded phase
+/// timings on exit, see write_trace().
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    usage();
+    return 1;
+  }
+
+  if (std::strcmp(argv[1], "--batch") == 0)
+  {
+    return run_batch(argc, argv);
+  }
+
+  int world_horizontal = num_horizontal;
+  int world_vertical = num_vertical;
+  bool cache = false;
+  int arg = 1;
+
+  if (!parse_options(argc, argv, arg, world_horizontal, world_vertical, cache) || arg >= argc || argc > arg + 2)
+  {
+    usage();
+    return 1;
+  }
+
+  const std::uint64_t source_hash = fnv1a_hash(read_file(argv[arg]));
+  const World world = load_world(argv[arg], source_hash, cache);
 
+  const int seed = 0;
 
+  Render_Options options;
+  options.num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+  std::shared_ptr<World_Instance> instance = argc > arg + 1
+    ? world.render_cached(argv[arg + 1], source_hash, tile_width, tile_height, world_horizontal, world_vertical, seed, options)
+    : world.render(tile_width, tile_height, world_horizontal, world_vertical, seed, options);
+
+  SDL_Engine e(instance, screen_width, screen_height);
+  e.run(); 
+
+  write_trace();
+}